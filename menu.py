@@ -3,6 +3,6 @@ import nuke
 # Inject our own node bar
 toolbar = nuke.menu("Nodes")
 sy = toolbar.addMenu( "SyLens")
-nodes = ('SyLens', 'SyCamera', 'SyUV', 'SyShader')
+nodes = ('SyLens', 'SyCamera', 'SyUV', 'SyShader', 'SyCompose', 'SyLensDeep')
 for nodename in nodes:
   sy.addCommand(nodename, 'nuke.createNode("%s")' % nodename)
\ No newline at end of file
@@ -23,6 +23,7 @@ extern "C" {
 }
 
 #include "SyDistorter.cpp"
+#include "SyPrewarm.cpp"
 
 using namespace DD::Image;
 
@@ -30,9 +31,16 @@ class SyCamera : public CameraOp
 {
 private:
 	double max_corner_u_, max_corner_v_;
+	
+	// The aspect and the lens the limits above were computed for
+	U64 limits_key_;
+	
 	bool distortion_enabled;
 	double _obsolete_aspect;
 	
+	// Bumped by sylens.py to ask for a warm-up, see SyPrewarm.h
+	int k_prewarm;
+	
 public:
 	static const Description description;
 
@@ -51,6 +59,13 @@ public:
 	SyCamera(Node* node) : CameraOp(node)
 	{
 		distortion_enabled = 1;
+		k_prewarm = 0;
+		limits_key_ = 0;
+	}
+	
+	~SyCamera()
+	{
+		SyPrewarm::cancel(this);
 	}
 	
 	void append(Hash& hash)
@@ -62,18 +77,47 @@ public:
 	
 	void _validate(bool for_real)
 	{
+		SY_TRACE_SPAN("SyCamera validate");
 		CameraOp::_validate(for_real);
 		
 		// Avoid recomputing things when not necessary
-		if(0 == distortion_enabled) return;
+		if(0 == distortion_enabled) {
+			SyPrewarm::cancel(firstOp());
+			return;
+		}
 		
 		// Set the distortion aspect based on haperture/vaperture correlation.
 		// For this to work haperture/vaperture must be set correctly
 		double asp = film_width() / film_height();
-		debug("Disto autoaspect (haperture/vaperture) %0.5f", asp);
-		distorter.set_aspect(asp);
-		distorter.recompute_if_needed();
-		update_distortion_limits();
+		
+		// Cameras validate a lot, and most of the time nothing changed
+		if(limits_key(asp) != limits_key_) {
+			debug("Disto autoaspect (haperture/vaperture) %0.5f", asp);
+			distorter.set_aspect(asp);
+			update_distortion_limits();
+			limits_key_ = limits_key(asp);
+		}
+		SyPrewarm::cancel(firstOp());
+	}
+	
+	int knob_changed(Knob* k)
+	{
+		if(SyPrewarm::is_prewarm_knob(k)) {
+			// Same aspect as _validate() takes
+			SyPrewarm::cancel(firstOp());
+			if(0 == distortion_enabled) return 1;
+			SyLutPrewarmJob* job = new SyLutPrewarmJob;
+			job->lens.copy_model_from(distorter);
+			job->aspect = film_width() / film_height();
+			SyPrewarm::schedule(firstOp(), job);
+			return 1;
+		}
+		if(k->is("showPanel") || distorter.is_lens_knob(k)) distorter.update_knobs(this);
+		if(distorter.is_lens_knob(k)) {
+			SyPrewarm::cancel(firstOp());
+			return 1;
+		}
+		return CameraOp::knob_changed(k);
 	}
 	
 	/* This is a virtual method on every CameraOp made exactly for this purpose, it's called from within
@@ -82,6 +126,7 @@ public:
 	{
 		Tab_knob(f, "SyLens");
 		distorter.knobs(f);
+		SyPrewarm::knobs(f, &k_prewarm);
 		
 		// Allow bypass
 		Knob* k_bypass = Bool_knob( f, &distortion_enabled, "disto_enabled");
@@ -132,6 +177,15 @@ public:
 		max_corner_v_ = max_corner.y + 1.0f;
 	}
 	
+	// Tells when the limits above have to be computed again
+	U64 limits_key(double aspect)
+	{
+		Hash h;
+		h.append(aspect);
+		h.append(distorter.compute_hash());
+		return h.value();
+	}
+	
 	// Distort a point in clip space. It's almost like a UV point (with embedded W)
 	// but it's already in the right Syntheyes coordinate system
 	void distort_p(Vector4& pt)
@@ -159,6 +213,7 @@ public:
 	*/
 	static void sy_camera_nlens_func(Scene* scene, CameraOp* cam, MatrixArray* transforms, VArray* v, int n, void*)
 	{
+		SY_TRACE_SPAN("SyCamera vertices");
 		SyCamera* sy_cam = dynamic_cast<SyCamera*>(cam);
 		for (int i=0; i < n; ++i) {
 			// We need to apply distortion in clip space, so do that. We will perform it on
@@ -0,0 +1,27 @@
+#ifndef SY_CLOCK_H
+#define SY_CLOCK_H
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+// Wall clock time in seconds since some arbitrary point, only good for measuring intervals
+inline double sy_clock()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return double(counter.QuadPart) / double(frequency.QuadPart);
+#else
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec + (tv.tv_usec / 1000000.0);
+#endif
+}
+
+#endif
@@ -0,0 +1,379 @@
+/*
+	SyCompose collapses the usual plate cleanup chain of
+
+		SyLens (remove disto) -> Transform -> SyLens (apply disto)
+
+	into one node. Instead of filtering the plate three times it composes the three mappings
+	and samples the source image exactly once, which is both faster and softens the plate less.
+
+	Both lens models use the Syntheyes algorithm through SyDistorter, and the model used for
+	reapplying the distortion can differ from the one used for removing it.
+*/
+
+// For max/min on containers
+#include <algorithm>
+
+// For string concats
+#include <sstream>
+
+#include "DDImage/Iop.h"
+#include "DDImage/Row.h"
+#include "DDImage/Pixel.h"
+#include "DDImage/Filter.h"
+#include "DDImage/Knobs.h"
+#include "DDImage/Matrix4.h"
+#include "SyDistorter.cpp"
+#include "SyPrewarm.cpp"
+
+using namespace DD::Image;
+
+static const char* const CLASS = "SyCompose";
+static const char* const HELP =  "This plugin removes lens distortion, applies a 2D transform "
+	"and applies lens distortion again in one go, sampling the input only once. "
+	"Use it instead of a SyLens - Transform - SyLens chain. "
+	"Contact me@julik.nl if you need help with the plugin.";
+
+#include "VERSION.h"
+
+// Names of the knobs of the distortion that gets reapplied, the removed one uses the standard names
+static const char* const apply_knob_names[] = { "apply_k", "apply_kcube", "apply_ushift", "apply_vshift",
+	"apply_model", "apply_kx", "apply_ky", "apply_kxy", "apply_kyx", 0 };
+
+class SyCompose : public Iop
+{
+	//Nuke statics
+
+	const char* Class() const { return CLASS; }
+	const char* node_help() const { return HELP; }
+	static const Iop::Description description;
+
+	Filter filter;
+
+	// The size of the plate that we distort
+	unsigned int plate_width_, plate_height_;
+
+	// The lens of the input plate, its distortion gets removed
+	SyDistorter remove_distorter;
+
+	// The lens that gets applied after the transform
+	SyDistorter apply_distorter;
+
+	// Use the lens of the input for reapplying the distortion
+	bool k_same_lens_;
+
+	// The lens that actually gets applied, either apply_distorter or with the same lens remove_distorter.
+	// apply_distorter belongs to the apply knobs so we never overwrite it.
+	SyDistorter* applied_distorter_;
+
+	// The 2D transform applied in undistorted space, and it's inverse for sampling
+	Matrix4 transform_, inverse_transform_;
+
+	// Bumped by sylens.py to ask for a warm-up, see SyPrewarm.h
+	int k_prewarm_;
+
+public:
+	SyCompose( Node *node ) : Iop ( node )
+	{
+		k_same_lens_ = true;
+		applied_distorter_ = &remove_distorter;
+		plate_width_ = 0;
+		plate_height_ = 0;
+		transform_.makeIdentity();
+		inverse_transform_.makeIdentity();
+		k_prewarm_ = 0;
+	}
+
+	~SyCompose()
+	{
+		SyPrewarm::cancel(this);
+	}
+
+	void _validate(bool for_real);
+	void _request(int x, int y, int r, int t, ChannelMask channels, int count);
+	void engine( int y, int x, int r, ChannelMask channels, Row& out );
+	void knobs( Knob_Callback f);
+	int knob_changed(Knob* k);
+
+	// Hashing for caches. We append our version to the cache hash, so that when you update
+	// the plugin all the caches will be flushed automatically
+	void append(Hash& hash) {
+		hash.append(VERSION);
+		hash.append(remove_distorter.compute_hash());
+		hash.append(k_same_lens_);
+		if(!k_same_lens_) hash.append(apply_distorter.compute_hash());
+		Iop::append(hash); // the super called he wants his pointers back
+	}
+
+private:
+	double toUv(double, int);
+	double fromUv(double, int);
+	void transform_px(const Matrix4& m, Vector2& xy);
+	void output_px_to_source(Vector2& xy);
+	void source_px_to_output(Vector2& xy);
+	Box map_bounds(const Box& box, bool to_output);
+	void prewarm();
+};
+
+static Iop* SyComposeCreate( Node* node ) {
+	return new SyCompose(node);
+}
+
+const Iop::Description SyCompose::description(CLASS, "Transform/SyCompose", SyComposeCreate);
+
+// Syntheyes UV coordinates start at the optical center of the image and go -1,1.
+// Same conversions as SyLens uses.
+double SyCompose::toUv(double absValue, int absSide)
+{
+  return (((absValue - 0.5f) / (absSide - 1.0f)) - 0.5f) * 2.0f;
+}
+
+double SyCompose::fromUv(double uvValue, int absSide)
+{
+  return (((uvValue / 2.0f) + 0.5f) * (absSide - 1.0f)) + 0.5f;
+}
+
+// Applies the matrix to the pixel coordinate, dividing out W so that projective
+// matrices work as well
+void SyCompose::transform_px(const Matrix4& m, Vector2& xy)
+{
+	Vector4 p = m * Vector4(xy.x, xy.y, 0.0f, 1.0f);
+	if(p.w != 0.0f) {
+		xy.x = p.x / p.w;
+		xy.y = p.y / p.w;
+	}
+}
+
+// Where to sample the source for the passed output pixel. This is the reverse of the chain:
+// undo the applied distortion, undo the transform, redo the distortion of the source.
+void SyCompose::output_px_to_source(Vector2& xy)
+{
+	xy.x = toUv(xy.x, plate_width_);
+	xy.y = toUv(xy.y, plate_height_);
+	applied_distorter_->remove_disto(xy);
+	xy.x = fromUv(xy.x, plate_width_);
+	xy.y = fromUv(xy.y, plate_height_);
+
+	transform_px(inverse_transform_, xy);
+
+	xy.x = toUv(xy.x, plate_width_);
+	xy.y = toUv(xy.y, plate_height_);
+	remove_distorter.apply_disto(xy);
+	xy.x = fromUv(xy.x, plate_width_);
+	xy.y = fromUv(xy.y, plate_height_);
+}
+
+// Where the passed source pixel ends up in the output, used for the bbox
+void SyCompose::source_px_to_output(Vector2& xy)
+{
+	xy.x = toUv(xy.x, plate_width_);
+	xy.y = toUv(xy.y, plate_height_);
+	remove_distorter.remove_disto(xy);
+	xy.x = fromUv(xy.x, plate_width_);
+	xy.y = fromUv(xy.y, plate_height_);
+
+	transform_px(transform_, xy);
+
+	xy.x = toUv(xy.x, plate_width_);
+	xy.y = toUv(xy.y, plate_height_);
+	applied_distorter_->apply_disto(xy);
+	xy.x = fromUv(xy.x, plate_width_);
+	xy.y = fromUv(xy.y, plate_height_);
+}
+
+/*
+Pushes the edges of the box through the composed mapping and returns the bounding box
+of the result. With a transform in the middle the extremes are not necessarily at the corners
+or the centerlines, so we walk the edges in small steps.
+*/
+Box SyCompose::map_bounds(const Box& box, bool to_output)
+{
+	const unsigned steps_per_edge = 32;
+
+	std::vector<Vector2> points;
+	for(unsigned i = 0; i <= steps_per_edge; i++) {
+		double t = double(i) / steps_per_edge;
+		float x = box.x() + (box.r() - box.x()) * t;
+		float y = box.y() + (box.t() - box.y()) * t;
+		points.push_back(Vector2(x, box.y()));
+		points.push_back(Vector2(x, box.t()));
+		points.push_back(Vector2(box.x(), y));
+		points.push_back(Vector2(box.r(), y));
+	}
+
+	float minX = 0, minY = 0, maxX = 0, maxY = 0;
+	for(unsigned i = 0; i < points.size(); i++) {
+		Vector2& pt = points[i];
+		if(to_output) {
+			source_px_to_output(pt);
+		} else {
+			output_px_to_source(pt);
+		}
+
+		if(i == 0) {
+			minX = maxX = pt.x;
+			minY = maxY = pt.y;
+		} else {
+			minX = std::min(minX, pt.x);
+			maxX = std::max(maxX, pt.x);
+			minY = std::min(minY, pt.y);
+			maxY = std::max(maxY, pt.y);
+		}
+	}
+
+	return Box((int)floor(minX), (int)floor(minY), (int)ceil(maxX), (int)ceil(maxY));
+}
+
+void SyCompose::_validate(bool for_real)
+{
+	SY_TRACE_SPAN("SyCompose validate");
+	
+	// Bookkeeping boilerplate
+	filter.initialize();
+	input0().validate(for_real);
+	copy_info();
+	set_out_channels(Mask_All);
+
+	// Do not blank away everything
+	info_.black_outside(false);
+
+	// The algo works in image aspect, not the pixel aspect. Like SyLens we take it from the
+	// full size format, so that proxy renders use the same lens
+	Format f = input0().format();
+	plate_width_ = f.width();
+	plate_height_ = f.height();
+	const Format& full = input0().full_size_format();
+	double aspect = float(full.width()) / float(full.height()) *  full.pixel_aspect();
+
+	remove_distorter.set_aspect(aspect);
+	remove_distorter.recompute_if_needed();
+
+	if(k_same_lens_) {
+		applied_distorter_ = &remove_distorter;
+	} else {
+		applied_distorter_ = &apply_distorter;
+		apply_distorter.set_precision(remove_distorter.precision());
+		apply_distorter.set_aspect(aspect);
+		apply_distorter.recompute_if_needed();
+	}
+
+	inverse_transform_ = transform_.inverse();
+
+	Info inf = input0().info();
+	info_.set(map_bounds(inf, true));
+
+	// We hold on to the LUTs ourselves now
+	SyPrewarm::cancel(firstOp());
+}
+
+void SyCompose::_request(int x, int y, int r, int t, ChannelMask channels, int count)
+{
+	SY_TRACE_SPAN("SyCompose request");
+	ChannelSet c1(channels); in_channels(0,c1);
+
+	// Request the part of the input that the requested area samples from, with
+	// some padding for the filter
+	const signed safetyPadding = 4;
+	Box needed = map_bounds(Box(x, y, r, t), false);
+	needed.pad(safetyPadding);
+
+	input0().request(needed.x(), needed.y(), needed.r(), needed.t(), channels, count);
+}
+
+// The image processor that works by scanline. All three steps of the chain are
+// folded into output_px_to_source(), so every pixel gets sampled from the input only once.
+void SyCompose::engine ( int y, int x, int r, ChannelMask channels, Row& out )
+{
+	SY_TRACE_SPAN("SyCompose row");
+	foreach(z, channels) out.writable(z);
+
+	Pixel pixel(channels);
+	const float sampleOff = 0.5f;
+
+	for (; x < r; x++) {
+		Vector2 sampleFromXY(x, y);
+		output_px_to_source(sampleFromXY);
+
+		input0().sample(
+			sampleFromXY.x + sampleOff , sampleFromXY.y + sampleOff,
+			1.0f,
+			1.0f,
+			&filter,
+			pixel
+		);
+
+		foreach (z, channels)
+		{
+			((float*)out[z])[x] = pixel[z];
+		}
+	}
+}
+
+void SyCompose::knobs( Knob_Callback f) {
+	Text_knob(f, "remove distortion");
+	remove_distorter.knobs(f);
+	remove_distorter.precision_knob(f);
+
+	Divider(f, 0);
+	Knob* transform_knob = Transform2d_knob(f, &transform_, "transform");
+	transform_knob->tooltip("The transform applied to the undistorted plate");
+
+	Divider(f, 0);
+	Knob* same_lens_knob = Bool_knob(f, &k_same_lens_, "same_lens");
+	same_lens_knob->label("same lens");
+	same_lens_knob->tooltip("When checked, the distortion that gets removed is also the one that gets applied "
+		"after the transform, and the apply controls below are greyed out");
+	same_lens_knob->set_flag(Knob::STARTLINE);
+
+	Text_knob(f, "apply distortion");
+	apply_distorter.knobs(f, apply_knob_names);
+
+	Divider(f, 0);
+	filter.knobs(f);
+	SyPrewarm::knobs(f, &k_prewarm_);
+
+	Divider(f, 0);
+
+	std::ostringstream ver;
+	ver << "SyCompose v." << VERSION;
+	Text_knob(f, ver.str().c_str());
+}
+
+int SyCompose::knob_changed(Knob* k)
+{
+	if(SyPrewarm::is_prewarm_knob(k)) {
+		prewarm();
+		return 1;
+	}
+	// The apply controls do nothing with the same lens
+	if(k->is("showPanel") || k->is("same_lens") || apply_distorter.is_lens_knob(k)) {
+		apply_distorter.enable_knobs(this, !k_same_lens_);
+	}
+	if(k->is("showPanel") || remove_distorter.is_lens_knob(k)) remove_distorter.update_knobs(this);
+	if(remove_distorter.is_lens_knob(k) || apply_distorter.is_lens_knob(k) || k->is("same_lens")) {
+		SyPrewarm::cancel(firstOp());
+		return 1;
+	}
+	return Iop::knob_changed(k);
+}
+
+// Hands the LUTs of both lenses to the warm-up thread, see SyPrewarm.h. With the same lens
+// there is only one LUT to build.
+void SyCompose::prewarm()
+{
+	SyPrewarm::cancel(firstOp());
+	if(!input0().tryValidate(false)) return;
+
+	const Format& full = input0().full_size_format();
+	double aspect = float(full.width()) / float(full.height()) *  full.pixel_aspect();
+
+	SyLutPrewarmJob* job = new SyLutPrewarmJob;
+	job->lens.copy_model_from(remove_distorter);
+	job->aspect = aspect;
+	SyPrewarm::schedule(firstOp(), job);
+
+	if(k_same_lens_) return;
+	job = new SyLutPrewarmJob;
+	job->lens.copy_model_from(apply_distorter);
+	job->aspect = aspect;
+	SyPrewarm::schedule(firstOp(), job);
+}
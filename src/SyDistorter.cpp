@@ -1,14 +1,54 @@
 // For max/min on containers
 #include <algorithm>
+#include <limits>
+#include <map>
 #include "DDImage/Thread.h"
 #include "SyDistorter.h"
+#include "SyWarpGrid.cpp"
+#include "SyTrace.cpp"
 
 // The number of discrete points we sample on the radius of the distortion.
 // The rest is going to be extrapolated
 static const unsigned int STEPS = 64;
 
+// How many points the batched kernels work on at a time
+static const unsigned POINT_BATCH = 256;
+
+// Names of the knobs generated by knobs(), in the order k, kcube, ushift, vshift, model, kx, ky, kxy, kyx
+static const char* const default_knob_names[] = { "k", "kcube", "ushift", "vshift", "model", "kx", "ky", "kxy", "kyx", 0 };
+
+static const char* const model_names[] = { "radial", "anamorphic", 0 };
+
+// The index of kx in the knob names, the anamorphic terms come after it
+static const unsigned ANAMORPHIC_FIRST_KNOB = 5;
+
+// The 2D table of the anamorphic model covers this much around the optical center (the frame is -1..1),
+// with this many nodes in both directions. That is a node every 24 pixels on a 4K plate, close enough
+// for the interpolated guess to need only a step or two of refinement.
+static const double ANAMORPHIC_TABLE_EXTENT = 1.5;
+static const unsigned ANAMORPHIC_TABLE_NODES = 257;
+
+// When to stop refining the inverse of the anamorphic model
+static const unsigned ANAMORPHIC_MAX_ITERATIONS = 20;
+static const double ANAMORPHIC_PRECISION = 1e-9;
+
+// Past the wraparound the factors go to zero and dividing by them would throw the points miles away,
+// so the first guess (which is also what we give up with) never magnifies more than this
+static const double ANAMORPHIC_MIN_FACTOR = 0.1;
+
+// The lookup tables of all the distorters in the plugin by their radial hash, so that
+// many nodes (or the views of one node) with the same lens compute the table only once
+static std::map<U64, SySharedLut*> shared_luts;
+static Lock shared_luts_lock;
+
 SyDistorter::SyDistorter()
 {
+	shared_lut_ = 0;
+	lut = 0;
+	knob_names_ = default_knob_names;
+	model_ = SY_MODEL_RADIAL;
+	precision_ = SY_PRECISION_DOUBLE;
+	kx_ = ky_ = kxy_ = kyx_ = 0;
 	set_coefficients(0.0f, 0.0f, 1.78);
 	center_shift_u_ = 0;
 	center_shift_v_ = 0;
@@ -25,37 +65,130 @@ U64 SyDistorter::compute_hash()
 	h.append(aspect_);
 	h.append(center_shift_u_);
 	h.append(center_shift_v_);
+	h.append(model_);
+	if(model_ == SY_MODEL_ANAMORPHIC) {
+		h.append(kx_);
+		h.append(ky_);
+		h.append(kxy_);
+		h.append(kyx_);
+	}
+	
+	// The float kernels give slightly different coordinates
+	if(precision_ == SY_PRECISION_FLOAT) h.append(precision_);
+	return h.value();
+}
+
+U64 SyDistorter::compute_radial_hash()
+{
+	Hash h;
+	h.append(k_);
+	h.append(k_cube_);
+	h.append(aspect_);
+	h.append(model_);
+	if(model_ == SY_MODEL_ANAMORPHIC) {
+		h.append(kx_);
+		h.append(ky_);
+		h.append(kxy_);
+		h.append(kyx_);
+	}
 	return h.value();
 }
 
 /*
 When the knobs change the values of the distorter it needs to update
 the internal lookup table. Therefore, it's handy to call this method
-in your _validate() routine
+in your _validate() routine. The shifts do not go into the table so changing
+only them keeps the table as is.
 */
-void SyDistorter::recompute_if_needed()
+bool SyDistorter::recompute_if_needed()
 {
-	// We have a shared data structure (the lookup table vector),
-	// when recomputing it we need to lock the world.
+	U64 new_hash = compute_radial_hash();
+	if(shared_lut_ && shared_lut_->key == new_hash) return false;
+	
+	// The tables are shared with the other distorters so we need to lock the world.
 	// http://forums.thefoundry.co.uk/phpBB2/viewtopic.php?t=5955
-	Lock* lock = new Lock;
-	lock->lock();
+	SySharedLut* unused = 0;
+	shared_luts_lock.lock();
+	bool found = use_shared_lut(new_hash, unused);
+	shared_luts_lock.unlock();
+	delete_shared_lut(unused);
+	if(found) return false;
+	
+	// Baking takes a while (the anamorphic table is a Newton solve per node), so it happens without the lock
+	// to not stall the other nodes. If another distorter bakes the same table meanwhile the first one in wins.
+	SySharedLut* baked = new SySharedLut;
+	baked->key = new_hash;
+	baked->users = 0;
+	recompute(baked->lut);
+	baked->step_inverse = 1.0 / baked->lut[1]->r;
+	baked->r_distorted_rising = 1;
+	for(unsigned i = 0; i < baked->lut.size(); i++) {
+		baked->r_float.push_back(baked->lut[i]->r);
+		baked->f_float.push_back(baked->lut[i]->f);
+		baked->r_distorted_float.push_back(baked->lut[i]->r_distorted);
+		if(i && baked->lut[i]->r_distorted > baked->lut[i - 1]->r_distorted && baked->r_distorted_rising == i) {
+			baked->r_distorted_rising = i + 1;
+		}
+	}
+	if(model_ == SY_MODEL_ANAMORPHIC) bake_anamorphic_table(*baked);
 	
-	int new_hash = compute_hash();
-	if(new_hash != hash) {
-		hash = new_hash;
-		recompute();
+	shared_luts_lock.lock();
+	found = use_shared_lut(new_hash, unused);
+	if(!found) {
+		shared_luts[new_hash] = baked;
+		use_shared_lut(new_hash, unused);
 	}
+	shared_luts_lock.unlock();
+	
+	delete_shared_lut(unused);
+	if(found) delete_shared_lut(baked);
+	return !found;
+}
+
+// Switches over to the shared table with the passed key if there is one. Call with shared_luts_lock held.
+// The table we used before comes back in unused when nobody else uses it, see release_lut().
+bool SyDistorter::use_shared_lut(U64 key, SySharedLut*& unused)
+{
+	std::map<U64, SySharedLut*>::iterator found = shared_luts.find(key);
+	if(found == shared_luts.end()) return false;
 	
-	lock->unlock();
-	delete lock;
+	unused = release_lut();
+	shared_lut_ = found->second;
+	shared_lut_->users++;
+	lut = &shared_lut_->lut;
+	return true;
+}
+
+// Lets go of the shared table. Call with shared_luts_lock held. When nobody else uses the table it gets taken
+// out of the shared ones and returned, to be deleted with delete_shared_lut() once the lock is let go.
+// The prewarm thread lets go of tables at idle priority, so it should hold the lock as briefly as it can.
+SySharedLut* SyDistorter::release_lut()
+{
+	SySharedLut* unused = 0;
+	if(shared_lut_) {
+		shared_lut_->users--;
+		if(shared_lut_->users == 0) {
+			shared_luts.erase(shared_lut_->key);
+			unused = shared_lut_;
+		}
+	}
+	shared_lut_ = 0;
+	lut = 0;
+	return unused;
+}
+
+void SyDistorter::delete_shared_lut(SySharedLut* shared)
+{
+	if(!shared) return;
+	clear_lut(shared->lut);
+	delete shared;
 }
 
 /* Sets the aspect of the input image */
-void SyDistorter::set_aspect(double a)
+bool SyDistorter::set_aspect(double a)
 {
 	aspect_ = a;
-	recompute_if_needed();
+	return recompute_if_needed();
 }
 
 /* Sets the distortion coefficients and the aspect */
@@ -73,9 +206,74 @@ void SyDistorter::set_center_shift(double u, double v)
 	center_shift_v_ = v;
 }
 
+void SyDistorter::set_anamorphic_terms(double kx, double ky, double kxy, double kyx)
+{
+	model_ = SY_MODEL_ANAMORPHIC;
+	kx_ = kx;
+	ky_ = ky;
+	kxy_ = kxy;
+	kyx_ = kyx;
+	recompute_if_needed();
+}
+
+void SyDistorter::set_radial()
+{
+	model_ = SY_MODEL_RADIAL;
+	recompute_if_needed();
+}
+
+int SyDistorter::model()
+{
+	return model_;
+}
+
+void SyDistorter::set_precision(int precision)
+{
+	precision_ = precision;
+}
+
+int SyDistorter::precision()
+{
+	return precision_;
+}
+
+double SyDistorter::center_shift_u()
+{
+	return center_shift_u_;
+}
+
+double SyDistorter::center_shift_v()
+{
+	return center_shift_v_;
+}
+
+void SyDistorter::set_model_from(const SyDistorter& other)
+{
+	copy_model_from(other);
+	recompute_if_needed();
+}
+
+void SyDistorter::copy_model_from(const SyDistorter& other)
+{
+	k_ = other.k_;
+	k_cube_ = other.k_cube_;
+	aspect_ = other.aspect_;
+	center_shift_u_ = other.center_shift_u_;
+	center_shift_v_ = other.center_shift_v_;
+	model_ = other.model_;
+	precision_ = other.precision_;
+	kx_ = other.kx_;
+	ky_ = other.ky_;
+	kxy_ = other.kxy_;
+	kyx_ = other.kyx_;
+}
+
 SyDistorter::~SyDistorter()
 {
-	clear_lut();
+	shared_luts_lock.lock();
+	SySharedLut* unused = release_lut();
+	shared_luts_lock.unlock();
+	delete_shared_lut(unused);
 }
 
 /*
@@ -83,28 +281,134 @@ Removes the distortion from the passed Vector2.
 The coordinates of the vector should be in the [{-1,1}-{-1,1}] space
 (Syntheyes UV coordinates)
 */
-void SyDistorter::remove_disto(Vector2& pt)
+bool SyDistorter::remove_disto(Vector2& pt)
 {
+	if(precision_ == SY_PRECISION_FLOAT && model_ == SY_MODEL_RADIAL && remove_disto_float(pt)) return true;
+	
 	// Bracket in centerpoint adjustment
 	pt.x += center_shift_u_;
 	pt.y += center_shift_v_;
 	
+	if(model_ == SY_MODEL_ANAMORPHIC) {
+		// The table gives a guess that is close enough for Newton's method to finish in a step or two.
+		// The nodes past the wraparound are NaN, the points next to them get the full treatment.
+		Vector2 guess = pt;
+		double x = guess.x, y = guess.y;
+		bool found = shared_lut_->inverse.lookup_bicubic(guess) && guess.x == guess.x && guess.y == guess.y;
+		if(found) {
+			x = guess.x;
+			y = guess.y;
+			found = refine_anamorphic(pt.x, pt.y, x, y);
+		}
+		if(!found) {
+			x = pt.x;
+			y = pt.y;
+			remove_anamorphic(x, y);
+		}
+		pt.set(x, y);
+		pt.x -= center_shift_u_;
+		pt.y -= center_shift_v_;
+		return found;
+	}
+	
 	double x = pt.x * aspect_;
 	double rd = sqrt((fabs(x) * fabs(x)) + (fabs(pt.y) * fabs(pt.y)));
-	double inv_f = undistort(rd);
+	bool sampled = false;
+	double inv_f = undistort(rd, sampled);
 	
 	pt.x = pt.x / inv_f;
 	pt.y = pt.y / inv_f;
 	
 	pt.x -= center_shift_u_;
 	pt.y -= center_shift_v_;
+	return sampled;
 }
 
-double SyDistorter::undistort(double radius_distorted)
+// remove_disto() rounds the point to float between the shift, the lookup and the division. GCC does not keep
+// those roundings in the same places once the steps are split into passes (C++ gets excess precision), which changes
+// the last bit, so this one stays a point at a time. The LUT lookup in it is a bisection, see lut_distorted_interval().
+unsigned SyDistorter::remove_disto(Vector2* points, unsigned count)
 {
-	if(radius_distorted < lut.back()->r_distorted) {
-		return undistort_sampled(radius_distorted);
+	unsigned sampled = 0;
+	for(unsigned i = 0; i < count; i++) sampled += remove_disto(points[i]);
+	return sampled;
+}
+
+/*
+The batched apply_disto(), with exactly what apply_disto() does for a point, in passes over a batch of points at a time:
+the radii first, then the factors, then the points. Only the middle pass looks into the LUT, with the direct index
+of lut_interval().
+*/
+unsigned SyDistorter::apply_disto(Vector2* points, unsigned count)
+{
+	if(precision_ == SY_PRECISION_FLOAT && model_ == SY_MODEL_RADIAL) return apply_disto_float(points, count);
+	
+	unsigned sampled = 0;
+	if(model_ == SY_MODEL_ANAMORPHIC) {
+		for(unsigned i = 0; i < count; i++) sampled += apply_disto(points[i]);
+		return sampled;
+	}
+	
+	float radii[POINT_BATCH];
+	for(unsigned start = 0; start < count; start += POINT_BATCH) {
+		Vector2* batch = points + start;
+		const unsigned n = std::min(count - start, POINT_BATCH);
+		for(unsigned i = 0; i < n; i++) {
+			batch[i].x -= center_shift_u_;
+			batch[i].y -= center_shift_v_;
+			float x = batch[i].x * aspect_;
+			radii[i] = sqrt(x * x + (batch[i].y * batch[i].y));
+		}
+		for(unsigned i = 0; i < n; i++) {
+			bool found;
+			radii[i] = distort_factor(radii[i], found);
+			sampled += found;
+		}
+		for(unsigned i = 0; i < n; i++) {
+			batch[i].x = batch[i].x * radii[i];
+			batch[i].y = batch[i].y * radii[i];
+			batch[i].x += center_shift_u_;
+			batch[i].y += center_shift_v_;
+		}
+	}
+	return sampled;
+}
+
+void SyDistorter::remove_disto(Vector3* points, unsigned count, double scale)
+{
+	if(model_ == SY_MODEL_ANAMORPHIC) {
+		for(unsigned i = 0; i < count; i++) {
+			Vector2 pt(points[i].x * scale, points[i].y * scale);
+			remove_disto(pt);
+			points[i].x = pt.x / scale;
+			points[i].y = pt.y / scale;
+		}
+		return;
+	}
+	
+	for(unsigned i = 0; i < count; i++) {
+		Vector3& pt = points[i];
+		
+		// Bracket in centerpoint adjustment
+		double x = pt.x * scale + center_shift_u_;
+		double y = pt.y * scale + center_shift_v_;
+		
+		double ax = x * aspect_;
+		double rd = sqrt((ax * ax) + (y * y));
+		bool sampled;
+		double inv_f = undistort(rd, sampled);
+		
+		pt.x = ((x / inv_f) - center_shift_u_) / scale;
+		pt.y = ((y / inv_f) - center_shift_v_) / scale;
+	}
+}
+
+double SyDistorter::undistort(double radius_distorted, bool& sampled)
+{
+	if(radius_distorted < lut->back()->r_distorted) {
+		return undistort_sampled(radius_distorted, sampled);
 	} else {
+		sampled = false;
 		return undistort_approximated(radius_distorted);
 	}
 }
@@ -121,14 +425,14 @@ up with undistortion because the image will likely wrap around and the alrogithm
 double SyDistorter::undistort_approximated(double rp)
 {
 	double r, f, approx_rp, delta;
-	r = lut.back()->r;
+	r = lut->back()->r;
 	const double inc = 0.01f;
 	while(true) {
 		r += inc;
 		f = distort_radial(r);
 		if(f < 0) {
 			// FAIL! At this point the F becomes negative
-			return lut.back()->f;
+			return lut->back()->f;
 		}
 		approx_rp = r * f;
 		if(approx_rp > rp) {
@@ -142,76 +446,409 @@ double SyDistorter::undistort_approximated(double rp)
 	}
 }
 
-double SyDistorter::undistort_sampled(double rd)
+/*
+The LUT nodes to interpolate between, the same ones a scan from the start of the table finds: left is the last
+node below r and right the first one above it (a node right at r is skipped). Returns false when r is not between
+two nodes. The nodes are evenly spaced in r, so the search starts at the node r falls on and only has to step over
+the rounding of the spacing.
+*/
+static inline bool lut_interval(const SySharedLut& shared, double r, unsigned& left, unsigned& right)
 {
-	std::vector<LutTuple*>::iterator tuple_it;
-	LutTuple* left = NULL;
-	LutTuple* right = NULL;
+	const Lut& table = shared.lut;
+	if(!(r > 0 && r < table.back()->r)) return false;
 	
-	for(tuple_it = lut.begin(); 
-		tuple_it != lut.end() && !(left && right);
-		tuple_it++) {
-			
-		if((*tuple_it)->r_distorted < rd) {
-			left = *tuple_it;
+	unsigned i = std::min((unsigned)(r * shared.step_inverse), STEPS - 1);
+	while(table[i]->r >= r) i--;
+	while(table[i + 1]->r < r) i++;
+	left = i;
+	right = table[i + 1]->r > r ? i + 1 : i + 2;
+	return true;
+}
+
+// The same for the distorted radii. They are not evenly spaced so this one bisects the part where they keep
+// going up, which is where the first node past rd is as long as the last node is past it. Anything else
+// (like rd beyond the table) gets the scan.
+static inline bool lut_distorted_interval(const SySharedLut& shared, double rd, unsigned& left, unsigned& right)
+{
+	const Lut& table = shared.lut;
+	if(rd > 0 && rd < table.back()->r_distorted) {
+		unsigned low = 1, high = shared.r_distorted_rising;
+		while(low < high) {
+			const unsigned mid = (low + high) / 2;
+			if(table[mid]->r_distorted > rd) {
+				high = mid;
+			} else {
+				low = mid + 1;
+			}
 		}
-		if ((*tuple_it)->r_distorted > rd) {
-			right = *tuple_it;
+		if(low < shared.r_distorted_rising) {
+			right = low;
+			left = table[right - 1]->r_distorted < rd ? right - 1 : right - 2;
+			return true;
 		}
 	}
 	
-	if(!(left && right)) {
+	bool found_left = false, found_right = false;
+	for(unsigned i = 0; i < table.size() && !(found_left && found_right); i++) {
+		if(table[i]->r_distorted < rd) {
+			left = i;
+			found_left = true;
+		}
+		if(table[i]->r_distorted > rd) {
+			right = i;
+			found_right = true;
+		}
+	}
+	return found_left && found_right;
+}
+
+double SyDistorter::undistort_sampled(double rd, bool& sampled)
+{
+	unsigned left = 0, right = 0;
+	sampled = lut_distorted_interval(*shared_lut_, rd, left, right);
+	if(!sampled) {
 		return undistort_approximated(rd);
 	}
 	
-	return lerp(rd, left->r_distorted, right->r_distorted, left->f, right->f);
+	const Lut& table = *lut;
+	return lerp(rd, table[left]->r_distorted, table[right]->r_distorted, table[left]->f, table[right]->f);
 }
+
+// The factor of the radial model at r, interpolated from the float copy of the LUT. The nodes are evenly
+// spaced so the interval comes straight from r, without searching. r has to be within the table.
+static inline float float_lut_factor(const SySharedLut& shared, float r)
+{
+	const unsigned i = std::min((unsigned)(r * (float)shared.step_inverse), STEPS - 1);
+	const float* radii = &shared.r_float[0];
+	const float* factors = &shared.f_float[0];
+	const float t = (r - radii[i]) / (radii[i + 1] - radii[i]);
+	return factors[i] + (factors[i + 1] - factors[i]) * t;
+}
+
+/*
+The float kernels, see SyPrecision. They do the same as the radial model in apply_disto() and remove_disto()
+but in float and from the float copy of the LUT. Points outside of the LUT return false without being touched
+and go through the double kernels.
+*/
+bool SyDistorter::apply_disto_float(Vector2& pt)
+{
+	const float x = pt.x - (float)center_shift_u_;
+	const float y = pt.y - (float)center_shift_v_;
+	const float ax = x * (float)aspect_;
+	const float r = sqrtf(ax * ax + y * y);
+	if(!(r < shared_lut_->r_float.back())) return false;
+	
+	const float f = float_lut_factor(*shared_lut_, r);
+	pt.x = x * f + (float)center_shift_u_;
+	pt.y = y * f + (float)center_shift_v_;
+	return true;
+}
+
+/*
+The same for many points. The loop has no branches (the points beyond the LUT get a radius within it
+and keep their coordinates), so the compiler is free to vectorize it. The points it skipped go through
+apply_disto() afterwards.
+*/
+unsigned SyDistorter::apply_disto_float(Vector2* points, unsigned count)
+{
+	const float shift_u = center_shift_u_;
+	const float shift_v = center_shift_v_;
+	const float aspect = aspect_;
+	const float max_r = shared_lut_->r_float.back();
+	
+	unsigned sampled = 0;
+	unsigned char beyond[POINT_BATCH];
+	for(unsigned start = 0; start < count; start += POINT_BATCH) {
+		Vector2* batch = points + start;
+		const unsigned n = std::min(count - start, POINT_BATCH);
+		unsigned within = 0;
+		for(unsigned i = 0; i < n; i++) {
+			const float x = batch[i].x - shift_u;
+			const float y = batch[i].y - shift_v;
+			const float ax = x * aspect;
+			const float r = sqrtf(ax * ax + y * y);
+			const bool inside = r < max_r;
+			const float f = float_lut_factor(*shared_lut_, inside ? r : 0.0f);
+			batch[i].x = inside ? x * f + shift_u : batch[i].x;
+			batch[i].y = inside ? y * f + shift_v : batch[i].y;
+			beyond[i] = !inside;
+			within += inside;
+		}
+		
+		sampled += within;
+		if(within == n) continue;
+		for(unsigned i = 0; i < n; i++) {
+			if(beyond[i]) apply_disto(batch[i]);
+		}
+	}
+	return sampled;
+}
+
+bool SyDistorter::remove_disto_float(Vector2& pt)
+{
+	const float x = pt.x + (float)center_shift_u_;
+	const float y = pt.y + (float)center_shift_v_;
+	const float ax = x * (float)aspect_;
+	const float rd = sqrtf(ax * ax + y * y);
+	
+	// Like undistort(), past the last node the distorted radii can go down again so we do not look there
+	const std::vector<float>& radii = shared_lut_->r_distorted_float;
+	if(!(rd < radii.back())) return false;
+	
+	// The distorted radii are not evenly spaced, so this direction still searches. The first node past rd is
+	// always before the radii turn down (the last one is past rd already), so the rising part is sorted.
+	const float* rising = &radii[0];
+	const unsigned right = std::upper_bound(rising + 1, rising + shared_lut_->r_distorted_rising, rd) - rising;
+	
+	const std::vector<float>& factors = shared_lut_->f_float;
+	const float t = (rd - radii[right - 1]) / (radii[right] - radii[right - 1]);
+	const float inv_f = factors[right - 1] + (factors[right] - factors[right - 1]) * t;
+	
+	pt.x = x / inv_f - (float)center_shift_u_;
+	pt.y = y / inv_f - (float)center_shift_v_;
+	return true;
+}
+
 /*
 Applies the distortion to the passed Vector2.
 The coordinates of the vector should be in the [{-1,1}-{-1,1}] space
 (Syntheyes UV coordinates)
 */
-void SyDistorter::apply_disto(Vector2& pt)
+bool SyDistorter::apply_disto(Vector2& pt)
 {
+	if(precision_ == SY_PRECISION_FLOAT && model_ == SY_MODEL_RADIAL && apply_disto_float(pt)) return true;
+	
 	// Bracket in centerpoint adjustment
 	// move camera gate -> distort -> move camera gate back
 	pt.x -= center_shift_u_;
 	pt.y -= center_shift_v_;
 	
+	// This direction is a polynomial, cheaper to compute than to look up
+	if(model_ == SY_MODEL_ANAMORPHIC) {
+		double x = pt.x, y = pt.y;
+		apply_anamorphic(x, y);
+		pt.set(x, y);
+		pt.x += center_shift_u_;
+		pt.y += center_shift_v_;
+		return true;
+	}
+	
+	// The radius and the factor are rounded to float like they always were, so that double keeps
+	// giving the same coordinates as older versions of the plugins (and SyReference)
 	float x = pt.x * aspect_;
 	float r = sqrt(x * x + (pt.y * pt.y));
+	bool sampled;
+	float f = distort_factor(r, sampled);
 	
-	std::vector<LutTuple*>::iterator tuple_it;
-	LutTuple* left = NULL;
-	LutTuple* right = NULL;
-	
-	// Find the neihgbouring defined points in the LUT
-	for(tuple_it = lut.begin(); 
-		tuple_it != lut.end() && !(left && right); 
-		tuple_it++) {
-		if((*tuple_it)->r < r) {
-			left = *tuple_it;
-		}
-		if ((*tuple_it)->r > r) {
-			right = *tuple_it;
-		}
+	pt.x = pt.x * f;
+	pt.y = pt.y * f;
+	
+	pt.x += center_shift_u_;
+	pt.y += center_shift_v_;
+	return sampled;
+}
+
+// The factor of the radial model at r, from the LUT. If we could not find neighbour points just compute it
+float SyDistorter::distort_factor(float r, bool& sampled)
+{
+	unsigned left = 0, right = 0;
+	sampled = lut_interval(*shared_lut_, r, left, right);
+	if(!sampled) return distort_radial(r);
+	
+	// TODO: spline interpolation instead of linear
+	const Lut& table = *lut;
+	return lerp(r, table[left]->r, table[right]->r, table[left]->f, table[right]->f);
+}
+
+bool SyDistorter::apply_disto(Vector2& pt, Vector2& d_dx, Vector2& d_dy)
+{
+	radial_jacobian(pt.x - center_shift_u_, pt.y - center_shift_v_, d_dx, d_dy);
+	return apply_disto(pt);
+}
+
+bool SyDistorter::remove_disto(Vector2& pt, Vector2& d_dx, Vector2& d_dy)
+{
+	const bool sampled = remove_disto(pt);
+	
+	// The Jacobian of the inverse is the inverse of the Jacobian at the undistorted point.
+	// remove_disto() brackets the shift the other way around than apply_disto() does
+	Vector2 fwd_dx, fwd_dy;
+	radial_jacobian(pt.x + center_shift_u_, pt.y + center_shift_v_, fwd_dx, fwd_dy);
+	
+	double det = (fwd_dx.x * fwd_dy.y) - (fwd_dy.x * fwd_dx.y);
+	
+	// Past the wraparound point the distortion folds onto itself, there is no sensible inverse
+	if(fabs(det) < 0.000001) {
+		d_dx.set(1, 0);
+		d_dy.set(0, 1);
+		return sampled;
+	}
+	
+	d_dx.set(fwd_dy.y / det, -fwd_dx.y / det);
+	d_dy.set(-fwd_dy.x / det, fwd_dx.x / det);
+	return sampled;
+}
+
+/*
+Computes the partial derivatives of the distortion at the passed point (relative to the optical center).
+With the distorted point being p * f(r), where r is the length of p with the aspect applied on X:
+
+  d(x * f)/dx = f + x * f'(r) * dr/dx, with dr/dx = aspect^2 * x / r
+  d(x * f)/dy = x * f'(r) * dr/dy, with dr/dy = y / r
+
+and the same for Y. f'(r) / r is 2k + 3kcube * r so the division by r never blows up at the center.
+*/
+void SyDistorter::radial_jacobian(double x, double y, Vector2& d_dx, Vector2& d_dy)
+{
+	if(model_ == SY_MODEL_ANAMORPHIC) {
+		anamorphic_jacobian(x, y, d_dx, d_dy);
+		return;
 	}
 	
-	float f;
+	double ax = x * aspect_;
+	double r = sqrt(ax * ax + y * y);
+	double f = distort_radial(r);
 	
-	// If we could not find neighbour points just compute it
-	if(left && right) {
-		// TODO: spline interpolation instead of linear
-		f = lerp(r, left->r, right->r, left->f, right->f);
+	// f'(r) divided by r
+	double g;
+	if (fabs(k_cube_) > 0.00001) {
+		g = 2 * k_ + 3 * k_cube_ * r;
 	} else {
-		f = distort_radial(r);
+		g = 2 * k_;
 	}
 	
-	pt.x = pt.x * f;
-	pt.y = pt.y * f;
+	double a2 = aspect_ * aspect_;
+	d_dx.set(f + g * a2 * x * x, g * a2 * x * y);
+	d_dy.set(g * x * y, f + g * y * y);
+}
+
+/*
+The same for the anamorphic model. Every direction has it's own factor now:
+
+  fx = f(r) + kx * X^2 + kxy * y^2, fy = f(r) + ky * y^2 + kyx * X^2
+
+so d(x * fx)/dx = fx + x * (f'(r) * dr/dx + 2 * kx * aspect^2 * x) and so on.
+*/
+void SyDistorter::anamorphic_jacobian(double x, double y, Vector2& d_dx, Vector2& d_dy)
+{
+	double ax = x * aspect_;
+	double r = sqrt(ax * ax + y * y);
+	double f = distort_radial(r);
+	double fx = f + kx_ * ax * ax + kxy_ * y * y;
+	double fy = f + ky_ * y * y + kyx_ * ax * ax;
 	
-	pt.x += center_shift_u_;
-	pt.y += center_shift_v_;
+	// f'(r) divided by r
+	double g;
+	if (fabs(k_cube_) > 0.00001) {
+		g = 2 * k_ + 3 * k_cube_ * r;
+	} else {
+		g = 2 * k_;
+	}
+	
+	double a2 = aspect_ * aspect_;
+	double dfx_dx = (g + 2 * kx_) * a2 * x;
+	double dfx_dy = (g + 2 * kxy_) * y;
+	double dfy_dx = (g + 2 * kyx_) * a2 * x;
+	double dfy_dy = (g + 2 * ky_) * y;
+	
+	d_dx.set(fx + x * dfx_dx, y * dfy_dx);
+	d_dy.set(x * dfx_dy, fy + y * dfy_dy);
+}
+
+// Applies the anamorphic model exactly to the coordinate relative to the optical center
+void SyDistorter::apply_anamorphic(double& x, double& y)
+{
+	double ax = x * aspect_;
+	double f = distort_radial(sqrt(ax * ax + y * y));
+	double fx = f + kx_ * ax * ax + kxy_ * y * y;
+	double fy = f + ky_ * y * y + kyx_ * ax * ax;
+	x = x * fx;
+	y = y * fy;
+}
+
+// True if the coordinate is on the part of the image that did not wrap around yet - both factors are positive
+// and the distortion is not folded over there
+bool SyDistorter::anamorphic_unfolded(double x, double y)
+{
+	double ax = x * aspect_;
+	double f = distort_radial(sqrt(ax * ax + y * y));
+	if(f + kx_ * ax * ax + kxy_ * y * y <= 0 || f + ky_ * y * y + kyx_ * ax * ax <= 0) return false;
+	
+	Vector2 d_dx, d_dy;
+	anamorphic_jacobian(x, y, d_dx, d_dy);
+	return (d_dx.x * d_dy.y) - (d_dy.x * d_dx.y) > 0.000001;
+}
+
+/*
+The anamorphic model has no closed form inverse, so we find the undistorted coordinate with Newton's method,
+starting from the coordinate divided by the distortion factors at it. Points past the wraparound have
+no inverse, for those we give up and return that first guess - much like the radial model uses the factor
+at the end of the LUT - and return false.
+*/
+bool SyDistorter::remove_anamorphic(double& x, double& y)
+{
+	const double target_x = x, target_y = y;
+	
+	double ax = x * aspect_;
+	double f = distort_radial(sqrt(ax * ax + y * y));
+	double fx = f + kx_ * ax * ax + kxy_ * y * y;
+	double fy = f + ky_ * y * y + kyx_ * ax * ax;
+	const double guess_x = (fx > 0 && fy > 0) ? x / std::max(fx, ANAMORPHIC_MIN_FACTOR) : x;
+	const double guess_y = (fx > 0 && fy > 0) ? y / std::max(fy, ANAMORPHIC_MIN_FACTOR) : y;
+	
+	x = guess_x;
+	y = guess_y;
+	if(refine_anamorphic(target_x, target_y, x, y)) return true;
+	
+	x = guess_x;
+	y = guess_y;
+	return false;
+}
+
+/*
+Moves x, y towards the undistorted coordinate of target with Newton's method. Steps that would not get closer
+or would leave the unfolded part of the image get halved, so we never end up on the other side of the wraparound.
+Returns false if it could not get there.
+*/
+bool SyDistorter::refine_anamorphic(double target_x, double target_y, double& x, double& y)
+{
+	double dx = x, dy = y;
+	apply_anamorphic(dx, dy);
+	double err_x = dx - target_x, err_y = dy - target_y;
+	double err = fabs(err_x) + fabs(err_y);
+	
+	for(unsigned i = 0; i < ANAMORPHIC_MAX_ITERATIONS; i++) {
+		if(fabs(err_x) < ANAMORPHIC_PRECISION && fabs(err_y) < ANAMORPHIC_PRECISION) return true;
+		if(!anamorphic_unfolded(x, y)) return false;
+		
+		Vector2 d_dx, d_dy;
+		anamorphic_jacobian(x, y, d_dx, d_dy);
+		double det = (d_dx.x * d_dy.y) - (d_dy.x * d_dx.y);
+		
+		double step_x = (d_dy.y * err_x - d_dy.x * err_y) / det;
+		double step_y = (d_dx.x * err_y - d_dx.y * err_x) / det;
+		
+		bool moved = false;
+		for(double t = 1; t > 0.01 && !moved; t *= 0.5) {
+			double nx = x - step_x * t, ny = y - step_y * t;
+			if(!anamorphic_unfolded(nx, ny)) continue;
+			
+			double ndx = nx, ndy = ny;
+			apply_anamorphic(ndx, ndy);
+			double n_err_x = ndx - target_x, n_err_y = ndy - target_y;
+			double n_err = fabs(n_err_x) + fabs(n_err_y);
+			if(n_err >= err) continue;
+			
+			x = nx;
+			y = ny;
+			err_x = n_err_x;
+			err_y = n_err_y;
+			err = n_err;
+			moved = true;
+		}
+		if(!moved) return false;
+	}
+	return false;
 }
 
 /*
@@ -238,6 +875,11 @@ so this method will first divide out the W value, distort the X and Y and then r
 the values back. The UV's are assumed to be in the camera-projected space (-0.5 to 0.5 covering full frustum)
  */
 void SyDistorter::distort_uv(Vector4& uv)
+{
+	distort_uv(uv, uv);
+}
+
+void SyDistorter::distort_uv(const Vector4& source, Vector4& dest)
 {
 	/* 
 	
@@ -257,10 +899,13 @@ void SyDistorter::distort_uv(Vector4& uv)
 	// Centerpoint is in the middle.
 	const double centerpoint_shift_in_uv_space = 0.5f;
 	
+	// Grab the W first since source and dest might be the same vector
+	const double w = source.w;
+	
 	// Move the coordinate by 0.5 since Syntheyes assume 0
 	// to be in the optical center of the image, and then scale them to -1..1
-	double x = ((uv.x / uv.w) - centerpoint_shift_in_uv_space) * factor;
-	double y = ((uv.y / uv.w) - centerpoint_shift_in_uv_space) * factor;
+	double x = ((source.x / w) - centerpoint_shift_in_uv_space) * factor;
+	double y = ((source.y / w) - centerpoint_shift_in_uv_space) * factor;
 	double z = sqrt(x*x + y*y);
 	
 	Vector2 syntheyes_uv(x, y);
@@ -271,7 +916,121 @@ void SyDistorter::distort_uv(Vector4& uv)
 	syntheyes_uv.x = (syntheyes_uv.x / factor) + centerpoint_shift_in_uv_space;
 	syntheyes_uv.y = (syntheyes_uv.y / factor) + centerpoint_shift_in_uv_space;
 	
-	uv.set(syntheyes_uv.x * uv.w, syntheyes_uv.y * uv.w, z, uv.w);
+	dest.set(syntheyes_uv.x * w, syntheyes_uv.y * w, z, w);
+}
+
+void SyDistorter::distort_uvs(const Vector4* source, Vector4* dest, unsigned count)
+{
+	for(unsigned i = 0; i < count; i++) {
+		distort_uv(source[i], dest[i]);
+	}
+}
+
+void SyDistorter::distort_uv(const Vector4& source, Vector4& dest, const SyWarpGrid& table)
+{
+	const double w = source.w;
+	
+	// Same coordinate juggling as in distort_uv() above, UV 0..1 to SY -1..1
+	double x = ((source.x / w) - 0.5) * 2;
+	double y = ((source.y / w) - 0.5) * 2;
+	double z = sqrt(x*x + y*y);
+	
+	Vector2 syntheyes_uv(x, y);
+	if(!table.lookup_bilinear(syntheyes_uv)) {
+		apply_disto(syntheyes_uv);
+	}
+	
+	dest.set(((syntheyes_uv.x / 2) + 0.5) * w, ((syntheyes_uv.y / 2) + 0.5) * w, z, w);
+}
+
+void SyDistorter::distort_uv_derivative(const Vector4& source, const Vector4& dest, Vector4& d_uv)
+{
+	const double w = source.w;
+	const double dw = d_uv.w;
+	
+	// The derivative of the plain UV, with the W divided out
+	double du = (d_uv.x - (source.x / w) * dw) / w;
+	double dv = (d_uv.y - (source.y / w) * dw) / w;
+	
+	// Going from UV to -1..1 and back scales both ways by 2, so the Jacobian is the same in UV
+	Vector2 d_dx, d_dy;
+	double x = ((source.x / w) - 0.5) * 2;
+	double y = ((source.y / w) - 0.5) * 2;
+	radial_jacobian(x - center_shift_u_, y - center_shift_v_, d_dx, d_dy);
+	
+	double d_distorted_u = (d_dx.x * du) + (d_dy.x * dv);
+	double d_distorted_v = (d_dx.y * du) + (d_dy.y * dv);
+	
+	// And premultiply again
+	d_uv.x = (d_distorted_u * w) + ((dest.x / w) * dw);
+	d_uv.y = (d_distorted_v * w) + ((dest.y / w) * dw);
+}
+
+/*
+Just distorting the corners of a rectangle is not enough since the distortion is the most
+extreme where the edges cross the lines going through the optical center. We walk all four edges
+in small steps and add the crossings with the optical center lines explicitly.
+*/
+void SyDistorter::apply_disto_to_bounds(double& left, double& bottom, double& right, double& top)
+{
+	const unsigned steps_per_edge = 16;
+	
+	std::vector<Vector2> edge_points;
+	for(unsigned i = 0; i <= steps_per_edge; i++) {
+		double t = double(i) / steps_per_edge;
+		double x = left + (right - left) * t;
+		double y = bottom + (top - bottom) * t;
+		edge_points.push_back(Vector2(x, bottom));
+		edge_points.push_back(Vector2(x, top));
+		edge_points.push_back(Vector2(left, y));
+		edge_points.push_back(Vector2(right, y));
+	}
+	
+	// The optical center is displaced by the shift
+	if(left < center_shift_u_ && right > center_shift_u_) {
+		edge_points.push_back(Vector2(center_shift_u_, bottom));
+		edge_points.push_back(Vector2(center_shift_u_, top));
+	}
+	if(bottom < center_shift_v_ && top > center_shift_v_) {
+		edge_points.push_back(Vector2(left, center_shift_v_));
+		edge_points.push_back(Vector2(right, center_shift_v_));
+	}
+	
+	for(unsigned i = 0; i < edge_points.size(); i++) {
+		Vector2& pt = edge_points[i];
+		apply_disto(pt);
+		if(i == 0) {
+			left = right = pt.x;
+			bottom = top = pt.y;
+		} else {
+			left = std::min(left, (double)pt.x);
+			right = std::max(right, (double)pt.x);
+			bottom = std::min(bottom, (double)pt.y);
+			top = std::max(top, (double)pt.y);
+		}
+	}
+}
+
+void SyDistorter::bake_apply_disto(SyWarpGrid& grid)
+{
+	for(unsigned j = 0; j < grid.height(); j++) {
+		for(unsigned i = 0; i < grid.width(); i++) {
+			Vector2 pt = grid.node_position(i, j);
+			apply_disto(pt);
+			grid.set(i, j, pt);
+		}
+	}
+}
+
+void SyDistorter::bake_remove_disto(SyWarpGrid& grid)
+{
+	for(unsigned j = 0; j < grid.height(); j++) {
+		for(unsigned i = 0; i < grid.width(); i++) {
+			Vector2 pt = grid.node_position(i, j);
+			remove_disto(pt);
+			grid.set(i, j, pt);
+		}
+	}
 }
 
 double SyDistorter::aspect()
@@ -291,25 +1050,93 @@ double SyDistorter::lerp(const double x, const double left_x, const double right
 // The caller should then set the aspect by itself using set_aspect()
 void SyDistorter::knobs( Knob_Callback f)
 {
-	Knob* _kKnob = Float_knob( f, &k_, "k" );
+	knobs(f, default_knob_names);
+}
+
+void SyDistorter::knobs( Knob_Callback f, const char* const* knob_names)
+{
+	Knob* _kKnob = Float_knob( f, &k_, knob_names[0] );
 	_kKnob->label("k");
 	_kKnob->tooltip("Set to the same distortion as applied by Syntheyes");
 	_kKnob->set_range(-0.3f, 0.3f, false);
 	
-	Knob* _kCubeKnob = Float_knob( f, &k_cube_, "kcube" );
+	Knob* _kCubeKnob = Float_knob( f, &k_cube_, knob_names[1] );
 	_kCubeKnob->label("cubic k");
 	_kCubeKnob->tooltip("Set to the same cubic distortion as applied by Syntheyes");
 	_kCubeKnob->set_range(-0.1f, 0.1f, false);
 	
-	Knob* _uKnob = Float_knob( f, &center_shift_u_, "ushift" );
+	Knob* _uKnob = Float_knob( f, &center_shift_u_, knob_names[2] );
 	_uKnob->label("horizontal shift");
 	_uKnob->tooltip("Set this to the X window offset if your optical center is off the centerpoint.");
 	_uKnob->set_range(-1.0f, 1.0f, true);
 	
-	Knob* _vKnob = Float_knob( f, &center_shift_v_, "vshift" );
+	Knob* _vKnob = Float_knob( f, &center_shift_v_, knob_names[3] );
 	_vKnob->label("vertical shift");
 	_vKnob->tooltip("Set this to the Y window offset if your optical center is off the centerpoint.");
 	_vKnob->set_range(-1.0f, 1.0f, true);
+	
+	// The anamorphic terms come last so that the radial controls stay where they always were
+	Knob* _modelKnob = Enumeration_knob( f, &model_, model_names, knob_names[4] );
+	_modelKnob->label("model");
+	_modelKnob->tooltip("radial is the standard Syntheyes lens model. anamorphic adds separate horizontal, "
+		"vertical and cross terms for lenses that do not distort the same way in every direction.");
+	
+	Knob* _kxKnob = Float_knob( f, &kx_, knob_names[5] );
+	_kxKnob->label("horizontal k");
+	_kxKnob->tooltip("Extra quartic distortion along X, only used by the anamorphic model");
+	_kxKnob->set_range(-0.3f, 0.3f, false);
+	
+	Knob* _kyKnob = Float_knob( f, &ky_, knob_names[6] );
+	_kyKnob->label("vertical k");
+	_kyKnob->tooltip("Extra quartic distortion along Y, only used by the anamorphic model");
+	_kyKnob->set_range(-0.3f, 0.3f, false);
+	
+	Knob* _kxyKnob = Float_knob( f, &kxy_, knob_names[7] );
+	_kxyKnob->label("horizontal cross k");
+	_kxyKnob->tooltip("Distortion along X that grows with the distance from the center along Y, only used by the anamorphic model");
+	_kxyKnob->set_range(-0.3f, 0.3f, false);
+	
+	Knob* _kyxKnob = Float_knob( f, &kyx_, knob_names[8] );
+	_kyxKnob->label("vertical cross k");
+	_kyxKnob->tooltip("Distortion along Y that grows with the distance from the center along X, only used by the anamorphic model");
+	_kyxKnob->set_range(-0.3f, 0.3f, false);
+	
+	knob_names_ = knob_names;
+}
+
+bool SyDistorter::is_lens_knob(Knob* k)
+{
+	for(unsigned i = 0; knob_names_[i]; i++) {
+		if(k->is(knob_names_[i])) return true;
+	}
+	return false;
+}
+
+void SyDistorter::enable_knobs(Op* op, bool enabled)
+{
+	for(unsigned i = 0; knob_names_[i]; i++) {
+		Knob* k = op->knob(knob_names_[i]);
+		
+		// kx, ky, kxy and kyx only do something in the anamorphic model
+		bool used = i < ANAMORPHIC_FIRST_KNOB || model_ == SY_MODEL_ANAMORPHIC;
+		if(k) k->enable(enabled && used);
+	}
+}
+
+void SyDistorter::update_knobs(Op* op)
+{
+	enable_knobs(op, true);
+}
+
+static const char* const precision_names[] = { "double", "float", 0 };
+
+void SyDistorter::precision_knob(Knob_Callback f)
+{
+	Knob* _precisionKnob = Enumeration_knob( f, &precision_, precision_names, "precision" );
+	_precisionKnob->label("precision");
+	_precisionKnob->tooltip("float computes the distortion in single precision, which is faster and stays within "
+		"a few thousandths of a pixel of double on an 8K plate. Pick double if you need the exact same coordinates "
+		"as the geometry and tracking nodes compute.");
 }
 
 // Creates knobs related to lens distortion including the aspect knob
@@ -321,20 +1148,37 @@ void SyDistorter::knobs_with_aspect( Knob_Callback f)
 	_aKnob->tooltip("Set to the aspect of your distorted plate (like 1.78 for 16:9)");
 }
 
-void SyDistorter::clear_lut()
+void SyDistorter::clear_lut(Lut& table)
 {
 	
 	// Clear out the LUT elements so that they don't leak. We could use std::auto_ptr
 	// as well...
 	std::vector<LutTuple*>::iterator tuple_it;
-	for(tuple_it = lut.begin(); tuple_it != lut.end(); tuple_it++) {
+	for(tuple_it = table.begin(); tuple_it != table.end(); tuple_it++) {
 		delete (*tuple_it);
 	}
-	lut.clear();
+	table.clear();
+}
+
+// Bakes the inverse of the anamorphic model into the table, relative to the optical center
+void SyDistorter::bake_anamorphic_table(SySharedLut& shared)
+{
+	SY_TRACE_SPAN("anamorphic table");
+	const double e = ANAMORPHIC_TABLE_EXTENT;
+	shared.inverse.resize(ANAMORPHIC_TABLE_NODES, ANAMORPHIC_TABLE_NODES, -e, -e, e, e);
+	
+	for(unsigned j = 0; j < ANAMORPHIC_TABLE_NODES; j++) {
+		for(unsigned i = 0; i < ANAMORPHIC_TABLE_NODES; i++) {
+			Vector2 node = shared.inverse.node_position(i, j);
+			double x = node.x, y = node.y;
+			if(!remove_anamorphic(x, y)) x = y = std::numeric_limits<double>::quiet_NaN();
+			shared.inverse.set(i, j, Vector2(x, y));
+		}
+	}
 }
 
-// Updates the internal lookup table
-void SyDistorter::recompute()
+// Fills the passed lookup table for the current coefficients and aspect
+void SyDistorter::recompute(Lut& table)
 {
 	double r = 0;
 	// Max radius will be the original radius at the top-right corner,
@@ -342,12 +1186,13 @@ void SyDistorter::recompute()
 	double max_r = sqrt((aspect_ * aspect_) + 1);
 	double increment = max_r / float(STEPS);
 	
-	clear_lut();
+	SY_TRACE_SPAN("LUT rebuild");
+	clear_lut(table);
 	
-	lut.push_back(new LutTuple(0,1));
+	table.push_back(new LutTuple(0,1));
 	for(unsigned i = 0; i < STEPS; i++) {
 		r += increment;
-		lut.push_back(new LutTuple(r, distort_radial(r)));
+		table.push_back(new LutTuple(r, distort_radial(r)));
 	}
 	
 	return;
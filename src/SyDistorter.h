@@ -1,3 +1,6 @@
+#ifndef SY_DISTORTER_H
+#define SY_DISTORTER_H
+
 // For max/min on containers
 #include <algorithm>
 
@@ -5,6 +8,8 @@
 #include "DDImage/Pixel.h"
 #include "DDImage/Filter.h"
 #include "DDImage/Knobs.h"
+#include "DDImage/Op.h"
+#include "SyWarpGrid.h"
 
 using namespace DD::Image;
 
@@ -22,6 +27,56 @@ public:
 
 typedef std::vector<LutTuple*> Lut;
 
+/*
+The distortion models. The radial model is the one Syntheyes uses by default, the distortion
+only depends on the distance from the optical center. The anamorphic model adds separate quartic
+terms for the horizontal and the vertical direction and cross terms between them on top of it:
+
+  x' = x * (f(r) + kx * X^2 + kxy * y^2)
+  y' = y * (f(r) + ky * y^2 + kyx * X^2)
+
+where f(r) is the radial model and X is x with the aspect applied. With all the extra terms at 0
+it gives the same distortion as the radial one.
+*/
+enum SyLensModel { SY_MODEL_RADIAL, SY_MODEL_ANAMORPHIC };
+
+/*
+How precisely apply_disto() and remove_disto() compute. SY_PRECISION_DOUBLE is the default and gives the exact
+coordinates the plugins always gave (apply_disto() rounds the radius and the factor to float halfway, like it always
+did). Use it for geometry, tracking data and cameras, where the points get distorted back and forth
+or end up far outside of the frame. SY_PRECISION_FLOAT computes the radial model in float from a float copy of
+the LUT, for the image nodes where every pixel gets distorted and a thousandth of a pixel is plenty. Measured
+against the double kernels, the float ones stay within 0.0000015 in Syntheyes coordinates inside the frame
+(0.006 pixels of an 8K plate) and within 0.000002 up to three frames out. sycheck holds them to that.
+
+The anamorphic model, the points outside of the LUT and the Jacobians are always computed in double.
+*/
+enum SyPrecision { SY_PRECISION_DOUBLE, SY_PRECISION_FLOAT };
+
+// A lookup table shared by all the distorters with the same coefficients and aspect. The shifts
+// are applied around the table, so distorters that only differ in shift (like the two views of a stereo plate)
+// use the same one.
+struct SySharedLut
+{
+	U64 key;
+	unsigned users;
+	Lut lut;
+	
+	// For the anamorphic model the radius does not tell the distortion, so the inverse (which needs
+	// Newton's method otherwise) gets baked into a 2D table instead
+	SyWarpGrid inverse;
+	
+	// The radii, the factors and the distorted radii of the LUT as plain arrays, for the float kernels
+	std::vector<float> r_float, f_float, r_distorted_float;
+	
+	// The nodes of the LUT are evenly spaced in r, so the interval of a radius is r times this
+	double step_inverse;
+	
+	// How many nodes from the start the distorted radii keep going up for. With strong barrel
+	// they turn back down within the table, the inverse is only searched before that.
+	unsigned r_distorted_rising;
+};
+
 class SyDistorter
 {
 
@@ -29,8 +84,22 @@ private:
    
 	// The cubic parameter will usually have the opposite sign of the main distortion (ie one is positive, the other negative).
 	double k_, k_cube_, aspect_, center_shift_u_, center_shift_v_;
-	U64 hash;
-	Lut lut;
+	
+	// One of SyLensModel, and the extra terms of the anamorphic model
+	int model_;
+	
+	// One of SyPrecision
+	int precision_;
+	double kx_, ky_, kxy_, kyx_;
+	
+	// Names of the knobs we made, so that knob_changed() can find them
+	const char* const* knob_names_;
+	SySharedLut* shared_lut_;
+	const Lut* lut;
+	
+	// Distorters share their LUT, so copying one would need to be counted
+	SyDistorter(const SyDistorter&);
+	SyDistorter& operator=(const SyDistorter&);
 	
 public:
 
@@ -40,8 +109,8 @@ public:
 	// Sets the coefficients that affect the distortion lookup table.
 	void set_coefficients(double k, double k_cube, double aspect);
 	
-	// Externally set the aspect
-	void set_aspect(double);
+	// Externally set the aspect. Returns true when the LUT had to be built for it, see recompute_if_needed()
+	bool set_aspect(double);
 	
 	// Returns the current aspect
 	double aspect();
@@ -49,42 +118,155 @@ public:
 	// Sets centerpoint shifts
 	void set_center_shift(double u, double v);
 	
+	// Switches to the anamorphic model with the passed extra terms (see SyLensModel), or back to the radial one
+	void set_anamorphic_terms(double kx, double ky, double kxy, double kyx);
+	void set_radial();
+	
+	// Returns one of SyLensModel
+	int model();
+	
+	// Picks the kernels apply_disto() and remove_disto() use, one of SyPrecision
+	void set_precision(int precision);
+	int precision();
+	
+	// Returns the centerpoint shifts
+	double center_shift_u();
+	double center_shift_v();
+	
+	// Takes over the model, the coefficients and the shifts of another distorter (but not it's LUT)
+	void set_model_from(const SyDistorter& other);
+	
+	// Same as set_model_from(), but leaves the LUT to the next recompute_if_needed(). Use this to hand
+	// a lens over to another thread and build the LUT there.
+	void copy_model_from(const SyDistorter& other);
+	
 	// Removes distortion in-place from the Vector2 at the passed reference.
-	// The passed vector should be in the [-1..1, -1..1] coordinates used in Syntheyes
-	void remove_disto(Vector2&);
+	// The passed vector should be in the [-1..1, -1..1] coordinates used in Syntheyes.
+	// Returns false when the point was beyond the lookup tables and had to be computed without them.
+	bool remove_disto(Vector2&);
+	
+	// Removes distortion in-place from the X and Y of count points, leaving Z as is.
+	// The points get multiplied by scale to bring them into the [-1..1, -1..1] Syntheyes coordinates
+	// and divided by it afterwards.
+	void remove_disto(Vector3* points, unsigned count, double scale);
 	
 	// Applies distortion in-place to the Vector2 at the passed reference.
-	// The passed vector should be in the [-1..1, -1..1] coordinates used in Syntheyes
-	void apply_disto(Vector2&);
+	// The passed vector should be in the [-1..1, -1..1] coordinates used in Syntheyes.
+	// Returns false when the point was beyond the LUT, like remove_disto().
+	bool apply_disto(Vector2&);
+	
+	// Applies or removes distortion in-place for count points, with exactly the same results as calling
+	// apply_disto() or remove_disto() on every one of them. Can be called from many threads at once
+	// for different points, see SyPointStream for doing that. Returns how many points were within the tables.
+	unsigned apply_disto(Vector2* points, unsigned count);
+	unsigned remove_disto(Vector2* points, unsigned count);
+	
+	// Applies distortion like apply_disto() and also computes the Jacobian of the distortion at that point,
+	// that is - how the distorted coordinate changes when the X (d_dx) or the Y (d_dy) of the passed one change.
+	// The derivatives come from the radial model directly so they are cheap to compute.
+	bool apply_disto(Vector2& pt, Vector2& d_dx, Vector2& d_dy);
+	
+	// Removes distortion like remove_disto() and also computes the Jacobian of the undistortion at that point
+	// (the inverse of the apply_disto() Jacobian at the undistorted point)
+	bool remove_disto(Vector2& pt, Vector2& d_dx, Vector2& d_dy);
 	
 	// Applies distortion to the passed Nuke UV UVW Vector4 coordinates at the passed reference.
 	// The UV coordinates should be premultiplied by the W component and be in the [0..1, 0..1] coordinates
 	void distort_uv(Vector4& uv);
 	
+	// Applies distortion to the UV read from source and writes the result into dest.
+	// source and dest are allowed to be the same vector.
+	void distort_uv(const Vector4& source, Vector4& dest);
+	
+	// Applies distortion to count UVs read from the source buffer and writes them into the dest buffer
+	// in one pass, so that there is no need to copy the UVs first. The buffers may be the same.
+	void distort_uvs(const Vector4* source, Vector4* dest, unsigned count);
+	
+	// Applies distortion to the UV like distort_uv() does, but takes the distorted coordinate
+	// from a table made with bake_apply_disto() instead of computing it. UVs outside of the
+	// area covered by the table get distorted exactly.
+	void distort_uv(const Vector4& source, Vector4& dest, const SyWarpGrid& table);
+	
+	// Carries the screen space derivative d_uv of the UV source through the distortion, dest being what
+	// distort_uv() made of source. Both UVs and the derivative are premultiplied by W like Nuke keeps them.
+	// Texture filtering takes it's footprint from the derivatives, so they need to go with the distorted UV.
+	void distort_uv_derivative(const Vector4& source, const Vector4& dest, Vector4& d_uv);
+	
+	// Replaces the passed rectangle (in the [-1..1, -1..1] Syntheyes coordinates) with the bounding
+	// rectangle of all its points after apply_disto(). Use this to find out which part of
+	// the source is going to be looked at when distorting a region.
+	void apply_disto_to_bounds(double& left, double& bottom, double& right, double& top);
+	
+	// Fills the grid with the result of apply_disto() at every node. Call this after recompute_if_needed()
+	// since the LUT is used for baking.
+	void bake_apply_disto(SyWarpGrid& grid);
+	
+	// Fills the grid with the result of remove_disto() at every node.
+	void bake_remove_disto(SyWarpGrid& grid);
+	
 	// Generates knobs into the passed knob callback, but without the aspect control
 	// The knobs will control the variables in the object directly
 	void knobs(Knob_Callback f);
+	
+	// Same as above, but with custom names for the k, kcube, ushift, vshift, model, kx, ky, kxy and kyx knobs
+	// (in that order). Use this when one node holds more than one distorter. The names have to outlive the node.
+	void knobs(Knob_Callback f, const char* const* knob_names);
+	
+	// Returns true if the knob is one of the lens controls made by knobs()
+	bool is_lens_knob(Knob* k);
+	
+	// Greys the knobs made by knobs() on op out, or back in. For when the node uses another lens instead of this one.
+	// The anamorphic terms stay greyed out with the radial model.
+	void enable_knobs(Op* op, bool enabled);
+	
+	// Greys the anamorphic terms out when the model is radial. Call from knob_changed() on showPanel
+	// and when a lens knob changes.
+	void update_knobs(Op* op);
+	
+	// Generates the knob for picking the precision, for the nodes that let the user choose
+	void precision_knob(Knob_Callback f);
 
 	// Generates knobs into the passed knob callback, including the aspect knov
 	// The knobs will control the variables in the object directly
 	void knobs_with_aspect(Knob_Callback f);
 	
 	// Call this from _validate(). This will, if necessary, update the internal LUT
-	// used by the distortion algorithm.
-	void recompute_if_needed();
+	// used by the distortion algorithm. Returns true when it had to build the LUT, and false
+	// when it was up to date or another distorter had built it already.
+	bool recompute_if_needed();
 	
 	// Returns the hash of all the distortion controls. This hash value can be used to
 	// uniquely classify the distortion model
 	U64 compute_hash();
+	
+	// Returns the hash of the model, the coefficients and the aspect only. Distorters with the same radial hash
+	// only differ in the shift, and apply_disto() of one is the other's moved by the difference in shift.
+	U64 compute_radial_hash();
 
 	
 private:
 	double lerp(double x, double left_x, double right_x, double left_y, double right_y);
-	double undistort(double);
-	double undistort_sampled(double);
+	double undistort(double, bool& sampled);
+	double undistort_sampled(double, bool& sampled);
 	double undistort_approximated(double);
 	double distort_sampled(double);
+	float distort_factor(float r, bool& sampled);
 	double distort_radial(double);
-	void recompute();
-	void clear_lut();
+	void radial_jacobian(double x, double y, Vector2& d_dx, Vector2& d_dy);
+	void anamorphic_jacobian(double x, double y, Vector2& d_dx, Vector2& d_dy);
+	bool apply_disto_float(Vector2& pt);
+	unsigned apply_disto_float(Vector2* points, unsigned count);
+	bool remove_disto_float(Vector2& pt);
+	void apply_anamorphic(double& x, double& y);
+	bool remove_anamorphic(double& x, double& y);
+	bool refine_anamorphic(double target_x, double target_y, double& x, double& y);
+	bool anamorphic_unfolded(double x, double y);
+	void recompute(Lut& table);
+	void bake_anamorphic_table(SySharedLut& shared);
+	void clear_lut(Lut& table);
+	SySharedLut* release_lut();
+	void delete_shared_lut(SySharedLut* shared);
+	bool use_shared_lut(U64 key, SySharedLut*& unused);
 };
+
+#endif
@@ -10,19 +10,26 @@ static const char* const HELP = "This node will undistort the XY coordinates of
 #include "DDImage/Knob.h"
 #include "DDImage/Knobs.h"
 #include "SyDistorter.cpp"
+#include "SyParallel.cpp"
+#include "SyPrewarm.cpp"
 #include <sstream>
 #include <iostream>
 
 using namespace DD::Image;
 
-
-class SyGeo : public GeoOp
+class SyGeo : public ModifyGeo
 {
 private:
 	
 	SyDistorter distorter;
 	float scale_factor;
 	
+	// The point lists being processed in modify_geometry()
+	std::vector<PointList*> point_jobs;
+	
+	// Bumped by sylens.py to ask for a warm-up, see SyPrewarm.h
+	int k_prewarm;
+	
 public:
 
 	static const Description description;
@@ -37,9 +44,15 @@ public:
 		return HELP;
 	}
 
-	SyGeo(Node* node) : GeoOp(node)
+	SyGeo(Node* node) : ModifyGeo(node)
 	{
 		scale_factor = 2.0f;
+		k_prewarm = 0;
+	}
+	
+	~SyGeo()
+	{
+		SyPrewarm::cancel(this);
 	}
 	
 	void append(Hash& hash) {
@@ -47,13 +60,14 @@ public:
 		hash.append(distorter.compute_hash());
 		hash.append(scale_factor);
 		hash.append(VERSION);
-		GeoOp::append(hash); // the super called he wants his pointers back
+		ModifyGeo::append(hash); // the super called he wants his pointers back
 	}
 	
 	void knobs(Knob_Callback f)
 	{
-		GeoOp::knobs(f);
+		ModifyGeo::knobs(f);
 		distorter.knobs_with_aspect(f);
+		SyPrewarm::knobs(f, &k_prewarm);
 		
 		Knob* factor_knob = Float_knob( f, &scale_factor, "scale" );
 		factor_knob->label("scale");
@@ -71,60 +85,74 @@ public:
 	void get_geometry_hash()
 	{
 		// Get all hashes up-to-date
-		GeoOp::get_geometry_hash();
+		ModifyGeo::get_geometry_hash();
+		
+		// We only ever move the points, so the primitives and the attributes
+		// of the input get passed through untouched
 		geo_hash[Group_Points].append(distorter.compute_hash());
 		geo_hash[Group_Points].append(scale_factor);
 	}
 	
 	void _validate(bool for_real)
 	{
+		SY_TRACE_SPAN("SyGeo validate");
 		distorter.recompute_if_needed();
-		input0()->validate(for_real);
-		GeoOp::_validate(for_real);
+		SyPrewarm::cancel(firstOp());
+		ModifyGeo::_validate(for_real);
 	}
 	
-	void undistort_points_of(int obj_idx, GeometryList& out)
+	int knob_changed(Knob* k)
 	{
-		// Save the pointer to the source point list first. We pull
-		// it from the GeoInfo for the object we are processing
-		GeoInfo& object = out[obj_idx];
-		const PointList* src_pts = object.point_list();
-		
-		// Allocate the destination points, they will be blanked out
-		// with garbage values that we have to manually replace with
-		// copied values from the source points
-		PointList* dest_points = out.writable_points(obj_idx);
-		
-		// Copy points from source to destination, removing distortion
-		// in the process:
-		for (unsigned i = 0; i < dest_points->size(); i++) {
-			Vector3 pt_source = (*src_pts)[i];
-			Vector3& pt_dest = (*dest_points)[i];
-			
-			// The Card has it's vertices in the [-0.5, 0.5] space with aspect applied
-			Vector2 xy(pt_source.x * scale_factor, pt_source.y * scale_factor);
-			distorter.remove_disto(xy);
-			
-			pt_dest.z = pt_source.z;
-			pt_dest.x = xy.x / scale_factor;
-			pt_dest.y = xy.y / scale_factor;
+		if(SyPrewarm::is_prewarm_knob(k)) {
+			// The aspect is a knob, so the lens is all the job needs
+			SyPrewarm::cancel(firstOp());
+			SyLutPrewarmJob* job = new SyLutPrewarmJob;
+			job->lens.copy_model_from(distorter);
+			job->aspect = distorter.aspect();
+			SyPrewarm::schedule(firstOp(), job);
+			return 1;
 		}
+		if(k->is("showPanel") || distorter.is_lens_knob(k)) distorter.update_knobs(this);
+		if(distorter.is_lens_knob(k)) {
+			SyPrewarm::cancel(firstOp());
+			return 1;
+		}
+		return ModifyGeo::knob_changed(k);
 	}
 	
-	void geometry_engine(Scene& scene, GeometryList& out)
+	// Runs on the worker threads, removes the distortion from a range of points in-place
+	static void undistort_points_chunk(unsigned job_idx, unsigned begin, unsigned end, void* userdata)
 	{
-		input0()->get_geometry(scene, out);
+		SY_TRACE_SPAN("SyGeo chunk");
+		SyGeo* self = (SyGeo*)userdata;
+		PointList& points = *self->point_jobs[job_idx];
 		
-		unsigned num_objects = out.objects();
-		for(unsigned i = 0; i < num_objects; i++) {
-			undistort_points_of(i, out);
-		}
+		// The Card has it's vertices in the [-0.5, 0.5] space with aspect applied
+		self->distorter.remove_disto(&points[begin], end - begin, self->scale_factor);
 	}
 	
-	// Needed to make the object selectable
-	void select_geometry(ViewerContext* ctx, GeometryList &scene_objects)
+	void modify_geometry(int obj, Scene& scene, GeometryList& out)
 	{
-		input0()->select_geometry(ctx, scene_objects);
+		// Nothing to do if the points of the input did not change and neither did our settings,
+		// the points we computed the last time are still good
+		if(!rebuild(Mask_Points)) return;
+		SY_TRACE_SPAN("SyGeo geometry");
+		
+		// Grab all the writable point lists first, so that the workers never have to touch
+		// the GeometryList. The writable points start out as a copy of the input points
+		unsigned num_objects = out.objects();
+		point_jobs.clear();
+		std::vector<unsigned> job_sizes;
+		for(unsigned i = 0; i < num_objects; i++) {
+			PointList* points = out.writable_points(i);
+			if(!points) continue;
+			
+			point_jobs.push_back(points);
+			job_sizes.push_back(points->size());
+		}
+		
+		SyParallel::run(job_sizes, undistort_points_chunk, this);
+		point_jobs.clear();
 	}
 };
 
@@ -133,4 +161,3 @@ static Op* build(Node* node)
 	return new SyGeo(node);
 }
 const Op::Description SyGeo::description(CLASS, build);
-
@@ -30,10 +30,29 @@
 #include "DDImage/Pixel.h"
 #include "DDImage/Filter.h"
 #include "DDImage/Knobs.h"
+#include "DDImage/ddImageVersionNumbers.h"
+
+// From Nuke 7 on we render in stripes of multiple rows across all channels at once.
+// Older versions get the classic row engine.
+#if kDDImageVersionMajorNum >= 7
+#define SYLENS_PLANAR 1
+#include "DDImage/PlanarIop.h"
+#endif
+
 #include "SyDistorter.cpp"
+#include "SyStats.cpp"
+#include "SyParallel.cpp"
+#include "SyPrewarm.cpp"
+#include "SyClock.h"
 
 using namespace DD::Image;
 
+#ifdef SYLENS_PLANAR
+typedef PlanarIop SyLensBase;
+#else
+typedef Iop SyLensBase;
+#endif
+
 static const char* const CLASS = "SyLens";
 static const char* const HELP =  "This plugin undistorts footage according "
 	"to the lens distortion model used by Syntheyes. "
@@ -41,10 +60,50 @@ static const char* const HELP =  "This plugin undistorts footage according "
 
 #include "VERSION.h"
 
-static const char* const output_mode_names[] = { "remove disto", "apply disto", 0 };
+static const char* const output_mode_names[] = { "remove disto", "apply disto", "apply st map", 0 };
+
+// How long after the last change of a lens knob we consider the drag to be over, in seconds
+static const double DRAG_SETTLE_TIME = 0.3;
+
+// Grid spacing for the interactive preview, in pixels of the plate
+static const unsigned PREVIEW_GRID_SPACING = 16;
+
+// How far outside of the plate the preview grid reaches, in Syntheyes coordinates
+static const double PREVIEW_GRID_EXTENT = 1.5;
+
+// The coarsest and the finest grid spacing for the fast mode, in pixels of the plate
+static const unsigned FAST_GRID_MAX_SPACING = 64;
+static const unsigned FAST_GRID_MIN_SPACING = 2;
 
-class SyLens : public Iop
+// Past this many nodes (like with a wrapped around bbox) the fast mode falls back to exact distortion
+static const unsigned FAST_GRID_MAX_NODES = 4 * 1024 * 1024;
+
+// The area of the fast grid gets rounded outwards to multiples of this (in Syntheyes coordinates),
+// so that views which only differ by a small shift end up with the same grid
+static const double FAST_GRID_AREA_QUANTUM = 0.125;
+
+// How far outside of the input bbox (on top of the reach of the filter, see update_skip_padding())
+// a source position may land and still be sampled, in pixels. Covers the error of the preview and fast modes.
+static const double SKIP_EMPTY_MARGIN = 4.0;
+
+// What the fast grid gets baked for. The key covers all of it, so a warm-up that fills this in the same
+// way as _validate() ends up with the grid the node is going to look for.
+struct SyFastGridSpec
 {
+	int output;
+	float tolerance;
+	bool compact;
+	unsigned plate_width, plate_height, full_width, full_height;
+	
+	// The area of the grid in the coordinates of the unshifted lens, and the key for SyWarpGridCache
+	double left, bottom, right, top;
+	U64 key;
+};
+
+class SyLens : public SyLensBase
+{
+	friend class SyLensPrewarmJob;
+	
 	//Nuke statics
 	
 	const char* Class() const { return CLASS; }
@@ -53,13 +112,14 @@ class SyLens : public Iop
 	
 	Filter filter;
 	
-	enum { UNDIST, REDIST };
+	enum { UNDIST, REDIST, APPLY_STMAP };
 	
 	// The original size of the plate that we distort
 	unsigned int plate_width_, plate_height_;
 	
-	// The size of the output
-	unsigned int out_width_, out_height_;
+	// The size of the plate at full resolution. In proxy mode the format gets scaled down, but the aspect
+	// and the grids go by this one so that they do not change when proxy is switched on and off.
+	unsigned int full_width_, full_height_;
 	
 	// Image aspect and NOT the pixel aspect Nuke furnishes us
 	double _aspect;
@@ -68,7 +128,7 @@ class SyLens : public Iop
 	double centerpoint_shift_u_, centerpoint_shift_v_;
 	
 	// Stuff driven by knobbz
-	bool k_trim_bbox_to_format_, k_only_format_output_, k_grow_format_;
+	bool k_trim_bbox_to_format_, k_only_format_output_, k_grow_format_, k_adaptive_filter_;
 	int k_output;
 	
 	// Sampling offset
@@ -80,22 +140,103 @@ class SyLens : public Iop
 	// The output format for the node
 	Format output_format;
 	
+	// What the last _validate() came up with, so that validating again with the same lens and input
+	// does not have to distort the bbox corners once more. The bbox is kept untrimmed.
+	U64 validated_key_;
+	Box validated_obox_;
+	
+	// Interactive preview. While a lens knob is being dragged (k_preview_state_ is 1) we map
+	// the pixels through a coarse grid and sample with the impulse filter
+	bool k_interactive_preview_;
+	int k_preview_state_;
+	double last_lens_change_;
+	Filter preview_filter_;
+	SyWarpGrid preview_grid_;
+	
+	// Fast mode. The exact distortion is only computed on a grid, with the spacing picked
+	// so that the interpolated coordinates stay within about k_fast_tolerance_ pixels of the exact ones.
+	// The grid is baked without the shift and shared with all the nodes and views with the same lens
+	// through SyWarpGridCache, the shift gets applied around the lookup.
+	bool k_fast_, k_compact_grid_;
+	float k_fast_tolerance_;
+	const SyWarpGrid* fast_grid_;
+	
+	// Bumped by sylens.py to ask for a warm-up, see SyPrewarm.h
+	int k_prewarm_;
+	
+	// ST map output. The position the pixel got sampled from, normalized to the input format,
+	// and optionally the Jacobian of the mapping in pixels (ds/dx, dt/dx, ds/dy, dt/dy)
+	Channel k_stmap_channels_[2];
+	Channel k_jacobian_channels_[4];
+	ChannelSet map_channels_;
+	
+	// The channels of the second input that carry the ST map for the "apply st map" mode
+	Channel k_stmap_input_channels_[2];
+	
+	// When the input is black outside of it's bbox we do not sample the parts of the rows
+	// that map to outside of it and fill them with black directly. The padding is how far outside
+	// a source position still picks something up from within the bbox, in pixels.
+	bool skip_empty_;
+	double skip_padding_;
+	
+	// Counters and timings. Nuke makes more than one instance of the node (for every view, for example),
+	// they all count into the stats of the first one so that the stats tab shows the whole node.
+	SyStats stats_;
+	const char* k_stats_text_;
+	
 public:
-	SyLens( Node *node ) : Iop ( node )
+	SyLens( Node *node ) : SyLensBase ( node )
 	{
 		k_output = UNDIST;
 		_aspect = 1.33f;
 		k_grow_format_ = false;
 		k_trim_bbox_to_format_ = false;
+		k_adaptive_filter_ = false;
+		k_interactive_preview_ = false;
+		k_preview_state_ = 0;
+		k_fast_ = false;
+		k_fast_tolerance_ = 0.01f;
+		k_compact_grid_ = false;
+		fast_grid_ = 0;
+		k_prewarm_ = 0;
+		last_lens_change_ = 0;
+		preview_filter_.type(Filter::Impulse);
 		xShift = 0;
 		yShift = 0;
+		validated_key_ = 0;
+		k_stmap_channels_[0] = k_stmap_channels_[1] = Chan_Black;
+		for(unsigned i = 0; i < 4; i++) k_jacobian_channels_[i] = Chan_Black;
+		k_stmap_input_channels_[0] = Chan_Red;
+		k_stmap_input_channels_[1] = Chan_Green;
+		skip_empty_ = false;
+		skip_padding_ = 0;
+		k_stats_text_ = "";
+		plate_width_ = plate_height_ = 0;
+		full_width_ = full_height_ = 0;
 	}
 	
 	void _computeAspects();
 	void _validate(bool for_real);
 	void _request(int x, int y, int r, int t, ChannelMask channels, int count);
+#ifdef SYLENS_PLANAR
+	// Stripes let us compute the distorted coordinate once per pixel for all the channels
+	// and write every channel plane in one go
+	bool useStripes() const { return true; }
+	size_t stripeHeight() const { return 32; }
+	PlanarI::PackedPreference packedPreference() const { return PlanarI::ePackedPreferenceUnpacked; }
+	void renderStripe(ImagePlane& plane);
+#else
 	void engine( int y, int x, int r, ChannelMask channels, Row& out );
+#endif
 	void knobs( Knob_Callback f);
+	int knob_changed(Knob* k);
+	void prewarm();
+	
+	// The second input is the ST map for the "apply st map" mode
+	int minimum_inputs() const { return 1; }
+	int maximum_inputs() const { return 2; }
+	const char* input_label(int n, char*) const { return n == 1 ? "stmap" : 0; }
+	bool updateUI(const OutputContext& context);
 	
 	// Hashing for caches. We append our version to the cache hash, so that when you update
 	// the plugin all the caches will be flushed automatically
@@ -106,21 +247,72 @@ public:
 		hash.append(k_trim_bbox_to_format_);
 		hash.append(xShift);
 		hash.append(yShift);
-		Iop::append(hash); // the super called he wants his pointers back
+		SyLensBase::append(hash); // the super called he wants his pointers back
 	}
 	
 	~SyLens () { 
+		SyPrewarm::cancel(this);
+		SyWarpGridCache::release(fast_grid_);
 	}
 private:
 	
 	int round(double x);
-	double toUv(double, int);
-	double fromUv(double, int);
-	void absolute_px_to_centered_uv(Vector2&, int, int);
-	void centered_uv_to_absolute_px(Vector2&, int, int);
-	void distort_px_into_source(Vector2& vec);
-	void undistort_px_into_destination(Vector2& vec);
+	static double toUv(double, int);
+	static double fromUv(double, int);
+	static void absolute_px_to_centered_uv(Vector2&, int, int);
+	static void centered_uv_to_absolute_px(Vector2&, int, int);
+	bool distort_px_into_source(Vector2& vec);
+	bool undistort_px_into_destination(Vector2& vec);
+	bool distort_px_into_source(Vector2& vec, Vector2& d_dx, Vector2& d_dy);
+	bool undistort_px_into_destination(Vector2& vec, Vector2& d_dx, Vector2& d_dy);
+	void jacobian_uv_to_px(Vector2& d_dx, Vector2& d_dy);
+	void sample_output_pixel(int x, int y, Pixel& pixel, Vector2& source, SyCounters& counters);
+	void sample_stmap_pixel(int x, const Row& map_row, Pixel& pixel, Vector2& source);
+	void add_map_channels(int x, int y, const Vector2& source, const ChannelSet& channels, Pixel& pixel);
+	ChannelSet stmap_input_channels();
+	Vector2 output_px_to_source(int x, int y);
+	double output_px_source_dx(int x, int y);
+	void clip_row_to_input_bbox(int y, int& x, int& r);
+	void update_skip_padding(const Box& obox);
+	bool previewing();
+	void update_preview_grid();
+	bool map_uv_exact(Vector2& uv);
+	static bool map_uv_exact(SyDistorter& lens, int output, Vector2& uv);
+	Vector2 lens_center_offset();
+	static Vector2 lens_center_offset(SyDistorter& lens, int output);
+	bool lookup_fast_grid(Vector2& uv);
+	void update_fast_grid(const Box& obox);
+	static void place_fast_grid(SyFastGridSpec& spec, SyDistorter& lens, const Box& obox, int x_shift, int y_shift);
+	static SyWarpGrid* bake_fast_grid(SyDistorter& source, const SyFastGridSpec& spec, const SyPrewarmJob* job);
+	static double fast_grid_error_px(const SyWarpGrid& grid, SyDistorter& lens, const SyFastGridSpec& spec, double tolerance);
+	static void bake_fast_grid_rows(unsigned job, unsigned begin, unsigned end, void* userdata);
+	static void fast_grid_error_rows(unsigned job, unsigned begin, unsigned end, void* userdata);
+	SyStats& node_stats();
+	void show_stats();
 	Box compute_needed_bbox_with_distortion(Box& source, unsigned w, unsigned h, int flag);
+	Box compute_output_geometry(Info& inf);
+	static Box bbox_with_distortion(SyDistorter& lens, unsigned plate_w, unsigned plate_h, const Box& inf, unsigned ow, unsigned oh, int flag);
+	static bool grow_shift(SyDistorter& lens, unsigned plate_w, unsigned plate_h, int& x_shift, int& y_shift);
+};
+
+/*
+Warms up what _validate() of SyLens builds - the LUT, and in fast mode the fast grid. The job works on
+a copy of the lens and goes through the same steps as _validate(), so the grid ends up under the key
+the node is going to look for.
+*/
+class SyLensPrewarmJob : public SyPrewarmJob
+{
+public:
+	SyDistorter lens;
+	double aspect;
+	bool fast, grow;
+	SyFastGridSpec spec;
+	Box input_box;
+	const SyWarpGrid* grid;
+	
+	SyLensPrewarmJob() { grid = 0; }
+	~SyLensPrewarmJob() { SyWarpGridCache::release(grid); }
+	void run();
 };
 
 // Since we do not need channel selectors or masks, we can use our raw Iop
@@ -170,6 +362,12 @@ Format. These will be only computed only if the Box actually intersects with the
 centerlines. The flag argument accepts the same UNDIST/REDIST flags.
 */
 Box SyLens::compute_needed_bbox_with_distortion(Box& inf, unsigned ow, unsigned oh, int flag)
+{
+	return bbox_with_distortion(distorter, plate_width_, plate_height_, inf, ow, oh, flag);
+}
+
+// Same as above with the lens and the plate passed in, so that the warm-up can use it
+Box SyLens::bbox_with_distortion(SyDistorter& lens, unsigned plate_w, unsigned plate_h, const Box& inf, unsigned ow, unsigned oh, int flag)
 {
 	// Just distorting the four corners of the bbox is NOT enough. We also need to find out whether
 	// the bbox intersects the centerlines. Since the distortion is the most extreme at the centerlines if
@@ -178,100 +376,499 @@ Box SyLens::compute_needed_bbox_with_distortion(Box& inf, unsigned ow, unsigned
 	int xMid = ow/2;
 	int yMid = oh/2;
 
-	std::vector<Vector2*> pointsOnBbox;
-	
+	// There are 8 points at most, so they live on the stack - this runs on every validate
+	Vector2 pointsOnBbox[8];
+	unsigned numPoints = 0;
+
 	// Add the standard two points - LR and TR
-	pointsOnBbox.push_back(new Vector2((float)inf.x(), (float)inf.y()));
-	pointsOnBbox.push_back(new Vector2((float)inf.r(), (float)inf.t()));
-	
+	pointsOnBbox[numPoints++] = Vector2((float)inf.x(), (float)inf.y());
+	pointsOnBbox[numPoints++] = Vector2((float)inf.r(), (float)inf.t());
+
 	// Add the TL and LR as well
-	pointsOnBbox.push_back(new Vector2((float)inf.x(), (float)inf.t()));
-	pointsOnBbox.push_back(new Vector2((float)inf.r(), (float)inf.y()));
-	
+	pointsOnBbox[numPoints++] = Vector2((float)inf.x(), (float)inf.t());
+	pointsOnBbox[numPoints++] = Vector2((float)inf.r(), (float)inf.y());
+
 	// If our box intersects the midplane on X add the points where the bbox crosses centerline
 	if((inf.x() < xMid) && (inf.r() > xMid)) {
 		// Find the two intersections and add them
-		pointsOnBbox.push_back( new Vector2(xMid, (float)inf.y()) );
-		pointsOnBbox.push_back( new Vector2(xMid, (float)inf.t()) );
+		pointsOnBbox[numPoints++] = Vector2(xMid, (float)inf.y());
+		pointsOnBbox[numPoints++] = Vector2(xMid, (float)inf.t());
 	}
-	
+
 	// If our box intersects the midplane on Y add the points where the bbox crosses centerline
 	if((inf.y() < yMid) && (inf.t() > yMid)) {
-		pointsOnBbox.push_back( new Vector2((float)inf.x(), yMid) );
-		pointsOnBbox.push_back( new Vector2((float)inf.r(), yMid) );
+		pointsOnBbox[numPoints++] = Vector2((float)inf.x(), yMid);
+		pointsOnBbox[numPoints++] = Vector2((float)inf.r(), yMid);
 	}
-	
-	std::vector<int> xValues;
-	std::vector<int> yValues;
-	
-	// Apply the operation to each bounding point
-	for(unsigned i = 0; i < pointsOnBbox.size(); i++) {
+
+	// Apply the operation to each bounding point and find the maximum coverage area as we go
+	int minX = 0, minY = 0, maxX = 0, maxY = 0;
+	for(unsigned i = 0; i < numPoints; i++) {
+		Vector2& pt = pointsOnBbox[i];
+		absolute_px_to_centered_uv(pt, plate_w, plate_h);
 		if(flag == UNDIST) {
-			undistort_px_into_destination(*pointsOnBbox[i]);
+			lens.remove_disto(pt);
 		} else {
-			distort_px_into_source(*pointsOnBbox[i]);
+			lens.apply_disto(pt);
 		}
-		xValues.push_back((int)pointsOnBbox[i]->x);
-		yValues.push_back((int)pointsOnBbox[i]->y);
+		centered_uv_to_absolute_px(pt, plate_w, plate_h);
+
+		const int x = (int)pt.x;
+		const int y = (int)pt.y;
+		if(i == 0 || x < minX) minX = x;
+		if(i == 0 || x > maxX) maxX = x;
+		if(i == 0 || y < minY) minY = y;
+		if(i == 0 || y > maxY) maxY = y;
 	}
-	
-	// Find the maximum coverage area for the given points
-	int minX, minY, maxX, maxY;
-	minX = *std::min_element(xValues.begin(), xValues.end());
-	maxX = *std::max_element(xValues.begin(), xValues.end());
-	minY = *std::min_element(yValues.begin(), yValues.end());
-	maxY = *std::max_element(yValues.begin(), yValues.end());
-	
+
 	return Box(minX, minY, maxX, maxY);
 }
 
 // Get a coordinate that we need to sample from the SOURCE distorted image to get at the absXY
 // values in the RESULT
-void SyLens::distort_px_into_source(Vector2& absXY) {
+// Returns false when the point was beyond the LUT, see SyDistorter::apply_disto()
+bool SyLens::distort_px_into_source(Vector2& absXY) {
 	absolute_px_to_centered_uv(absXY, plate_width_, plate_height_);
-	distorter.apply_disto(absXY);
+	bool sampled = distorter.apply_disto(absXY);
 	centered_uv_to_absolute_px(absXY, plate_width_, plate_height_);
+	return sampled;
 }
 
 // This is still a little wrongish but less wrong than before
-void SyLens::undistort_px_into_destination(Vector2& absXY) {
+bool SyLens::undistort_px_into_destination(Vector2& absXY) {
 	absolute_px_to_centered_uv(absXY, plate_width_, plate_height_);
-	distorter.remove_disto(absXY);
+	bool sampled = distorter.remove_disto(absXY);
 	centered_uv_to_absolute_px(absXY, plate_width_, plate_height_);
+	return sampled;
 }
- 
-// The image processor that works by scanline. Y is the scanline offset, x is the pix,
-// r is the length of the row. We are now effectively in the undistorted coordinates, mind you!
-void SyLens::engine ( int y, int x, int r, ChannelMask channels, Row& out )
+
+// Same as above, but also gives the footprint of the output pixel in the source (the Jacobian)
+bool SyLens::distort_px_into_source(Vector2& absXY, Vector2& d_dx, Vector2& d_dy) {
+	absolute_px_to_centered_uv(absXY, plate_width_, plate_height_);
+	bool sampled = distorter.apply_disto(absXY, d_dx, d_dy);
+	centered_uv_to_absolute_px(absXY, plate_width_, plate_height_);
+	jacobian_uv_to_px(d_dx, d_dy);
+	return sampled;
+}
+
+bool SyLens::undistort_px_into_destination(Vector2& absXY, Vector2& d_dx, Vector2& d_dy) {
+	absolute_px_to_centered_uv(absXY, plate_width_, plate_height_);
+	bool sampled = distorter.remove_disto(absXY, d_dx, d_dy);
+	centered_uv_to_absolute_px(absXY, plate_width_, plate_height_);
+	jacobian_uv_to_px(d_dx, d_dy);
+	return sampled;
+}
+
+// Counts a radius that was found in the LUT, or one that was not
+static inline void count_lookup(SyCounters& counters, bool sampled)
 {
+	if(sampled) {
+		counters.lut_lookups++;
+	} else {
+		counters.lut_fallbacks++;
+	}
+}
+
+// The centered UVs are scaled differently on X and Y (the plate is not square),
+// so the cross terms of the Jacobian have to be rescaled when going to pixels
+void SyLens::jacobian_uv_to_px(Vector2& d_dx, Vector2& d_dy) {
+	double w = plate_width_ - 1.0f;
+	double h = plate_height_ - 1.0f;
+	d_dx.y = d_dx.y * h / w;
+	d_dy.x = d_dy.x * w / h;
+}
+
+// Computes the pixel at x,y of the output by sampling the input at the distorted (or undistorted)
+// coordinate. All the channels of the passed Pixel get filled at once. The position that got sampled
+// (the center of the sampled area in the pixels of the input) is returned in source.
+// Counts the LUT lookups into the counters of the row, which go into the thread counters once per row
+void SyLens::sample_output_pixel(int x, int y, Pixel& pixel, Vector2& source, SyCounters& counters)
+{
+	const float sampleOff = 0.5f;
 	
-	foreach(z, channels) out.writable(z);
+	Vector2 sampleFromXY(x - xShift, y - yShift);
 	
-	Pixel pixel(channels);
-	const float sampleOff = 0.5f;
+	if(previewing()) {
+		// Interpolate the coordinates from the coarse grid and take the nearest pixel,
+		// the exact result comes in once the knob is released
+		absolute_px_to_centered_uv(sampleFromXY, plate_width_, plate_height_);
+		if(!preview_grid_.lookup_bilinear(sampleFromXY)) count_lookup(counters, map_uv_exact(sampleFromXY));
+		centered_uv_to_absolute_px(sampleFromXY, plate_width_, plate_height_);
+		
+		source = Vector2(sampleFromXY.x + sampleOff, sampleFromXY.y + sampleOff);
+		input0().sample(
+			source.x, source.y,
+			1.0f, 
+			1.0f,
+			&preview_filter_,
+			pixel
+		);
+		return;
+	}
 	
-	Vector2 sampleFromXY(0.0f, 0.0f);
-	for (; x < r; x++) {
+	// The adaptive filter needs the exact Jacobian, so the fast mode only kicks in without it
+	if(k_fast_ && !k_adaptive_filter_) {
+		absolute_px_to_centered_uv(sampleFromXY, plate_width_, plate_height_);
+		if(!lookup_fast_grid(sampleFromXY)) count_lookup(counters, map_uv_exact(sampleFromXY));
+		centered_uv_to_absolute_px(sampleFromXY, plate_width_, plate_height_);
 		
-		sampleFromXY = Vector2(x - xShift, y - yShift);
+		source = Vector2(sampleFromXY.x + sampleOff, sampleFromXY.y + sampleOff);
+		input0().sample(
+			source.x, source.y,
+			1.0f, 
+			1.0f,
+			&filter,
+			pixel
+		);
+		return;
+	}
+	
+	if(k_adaptive_filter_) {
+		Vector2 d_dx, d_dy;
 		
+		// Size the filter after the footprint of our pixel in the source, so that areas
+		// that get squeezed by the distortion are filtered instead of aliasing
 		if( k_output == UNDIST) {
-			distort_px_into_source(sampleFromXY);
+			count_lookup(counters, distort_px_into_source(sampleFromXY, d_dx, d_dy));
 		} else {
-			undistort_px_into_destination(sampleFromXY);
+			count_lookup(counters, undistort_px_into_destination(sampleFromXY, d_dx, d_dy));
 		}
 		
-		// Sample from the input node at the coordinates
-		// half a pixel has to be added here because sample() takes the first two
-		// arguments as the center of the rectangle to sample. By not adding 0.5 we'd
-		// have to deal with a slight offset which is *not* desired.
+		source = Vector2(sampleFromXY.x + sampleOff, sampleFromXY.y + sampleOff);
 		input0().sample(
-			sampleFromXY.x + sampleOff , sampleFromXY.y + sampleOff, 
-			1.0f, 
-			1.0f,
+			source,
+			d_dx,
+			d_dy,
 			&filter,
 			pixel
 		);
+		return;
+	}
+	
+	if( k_output == UNDIST) {
+		count_lookup(counters, distort_px_into_source(sampleFromXY));
+	} else {
+		count_lookup(counters, undistort_px_into_destination(sampleFromXY));
+	}
+	
+	// Sample from the input node at the coordinates
+	// half a pixel has to be added here because sample() takes the first two
+	// arguments as the center of the rectangle to sample. By not adding 0.5 we'd
+	// have to deal with a slight offset which is *not* desired.
+	source = Vector2(sampleFromXY.x + sampleOff, sampleFromXY.y + sampleOff);
+	input0().sample(
+		source.x, source.y,
+		1.0f, 
+		1.0f,
+		&filter,
+		pixel
+	);
+}
+
+// Samples the input where the ST map in the passed row points to. There is no distortion math
+// involved here at all, the map already says where to sample.
+void SyLens::sample_stmap_pixel(int x, const Row& map_row, Pixel& pixel, Vector2& source)
+{
+	// ST maps are normalized to the input format, 0,0 being the lower left corner of the first pixel
+	source.x = map_row[k_stmap_input_channels_[0]][x] * plate_width_;
+	source.y = map_row[k_stmap_input_channels_[1]][x] * plate_height_;
+	
+	input0().sample(
+		source.x, source.y,
+		1.0f,
+		1.0f,
+		&filter,
+		pixel
+	);
+}
+
+// Puts the ST map and the Jacobian of the output pixel into the requested channels of the pixel,
+// so that other nodes and packages can reuse the warp without running SyLens again
+void SyLens::add_map_channels(int x, int y, const Vector2& source, const ChannelSet& channels, Pixel& pixel)
+{
+	if(map_channels_.empty()) return;
+	
+	if(k_stmap_channels_[0] != Chan_Black && channels.contains(k_stmap_channels_[0])) {
+		pixel[k_stmap_channels_[0]] = source.x / plate_width_;
+	}
+	if(k_stmap_channels_[1] != Chan_Black && channels.contains(k_stmap_channels_[1])) {
+		pixel[k_stmap_channels_[1]] = source.y / plate_height_;
+	}
+	
+	// The Jacobian is only known when we do the distortion ourselves
+	if(k_output == APPLY_STMAP) return;
+	
+	bool want_jacobian = false;
+	for(unsigned i = 0; i < 4; i++) {
+		if(k_jacobian_channels_[i] != Chan_Black && channels.contains(k_jacobian_channels_[i])) want_jacobian = true;
+	}
+	if(!want_jacobian) return;
+	
+	Vector2 xy(x - xShift, y - yShift), d_dx, d_dy;
+	if( k_output == UNDIST) {
+		distort_px_into_source(xy, d_dx, d_dy);
+	} else {
+		undistort_px_into_destination(xy, d_dx, d_dy);
+	}
+	
+	const float derivatives[4] = { d_dx.x, d_dx.y, d_dy.x, d_dy.y };
+	for(unsigned i = 0; i < 4; i++) {
+		if(k_jacobian_channels_[i] != Chan_Black && channels.contains(k_jacobian_channels_[i])) {
+			pixel[k_jacobian_channels_[i]] = derivatives[i];
+		}
+	}
+}
+
+// The channels we read from the ST map input
+ChannelSet SyLens::stmap_input_channels()
+{
+	ChannelSet map_channels;
+	map_channels += k_stmap_input_channels_[0];
+	map_channels += k_stmap_input_channels_[1];
+	return map_channels;
+}
+
+// Where the center of the output pixel at x,y samples from in the input, with the exact distortion
+Vector2 SyLens::output_px_to_source(int x, int y)
+{
+	Vector2 xy(x - xShift, y - yShift);
+	if( k_output == UNDIST) {
+		distort_px_into_source(xy);
+	} else {
+		undistort_px_into_destination(xy);
+	}
+	return Vector2(xy.x + 0.5f, xy.y + 0.5f);
+}
+
+// How fast the source X of output_px_to_source() changes with the output X at x,y
+double SyLens::output_px_source_dx(int x, int y)
+{
+	Vector2 xy(x - xShift, y - yShift);
+	Vector2 d_dx, d_dy;
+	if( k_output == UNDIST) {
+		distort_px_into_source(xy, d_dx, d_dy);
+	} else {
+		undistort_px_into_destination(xy, d_dx, d_dy);
+	}
+	return d_dx.x;
+}
+
+/*
+Narrows x and r down to the part of the output row y that samples from within the bbox of the input.
+When nothing in the row does, x is set to r. As long as the radial distortion does not fold the image over
+it keeps the order of the pixels along a row, so the source X only grows with the output X and we can find
+the ends of the span by bisection instead of mapping every pixel. The source Y of a row bows towards (or away from)
+the optical center, so it's extremes are at the ends of the span and where the span crosses the optical center.
+The anamorphic terms bend the rows differently, so with that model the row is left as is.
+*/
+void SyLens::clip_row_to_input_bbox(int y, int& x, int& r)
+{
+	if(x >= r) return;
+	
+	const Info& in = input0().info();
+	const double left = in.x() - skip_padding_;
+	const double right = in.r() + skip_padding_;
+	const double bottom = in.y() - skip_padding_;
+	const double top = in.t() + skip_padding_;
+	
+	if(distorter.model() != SY_MODEL_RADIAL) return;
+	
+	// The optical center in output pixels. apply_disto() moves the image center by the shift
+	// before distorting and remove_disto() the other way around.
+	double center_u = (k_output == UNDIST) ? distorter.center_shift_u() : -distorter.center_shift_u();
+	const int center_x = (int)fromUv(center_u, plate_width_) + xShift;
+	
+	// A very strong distortion can fold the image over (even on one side of the row only, with a shifted center),
+	// the bisection would go wrong then. The source X grows the slowest at the ends of the row with barrel
+	// distortion and at the optical center with pincushion, so if it grows there it grows along the whole row.
+	if(output_px_source_dx(x, y) <= 0 || output_px_source_dx(r - 1, y) <= 0) return;
+	if(center_x > x && center_x < r - 1 && output_px_source_dx(center_x, y) <= 0) return;
+	
+	// The first pixel that samples right of the left edge of the bbox
+	int lo = x, hi = r;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(output_px_to_source(mid, y).x < left) lo = mid + 1; else hi = mid;
+	}
+	const int span_x = lo;
+	
+	// The first pixel that samples right of the right edge of the bbox
+	hi = r;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(output_px_to_source(mid, y).x <= right) lo = mid + 1; else hi = mid;
+	}
+	const int span_r = lo;
+	
+	if(span_x >= span_r) {
+		x = r;
+		return;
+	}
+	
+	double min_y = output_px_to_source(span_x, y).y;
+	double max_y = min_y;
+	const int probes[2] = { span_r - 1, center_x };
+	const unsigned probe_count = (center_x > span_x && center_x < span_r - 1) ? 2 : 1;
+	for(unsigned i = 0; i < probe_count; i++) {
+		double sy = output_px_to_source(probes[i], y).y;
+		min_y = std::min(min_y, sy);
+		max_y = std::max(max_y, sy);
+	}
+	
+	if(max_y < bottom || min_y > top) {
+		x = r;
+		return;
+	}
+	
+	x = span_x;
+	r = span_r;
+}
+
+/*
+Finds out how far the filter reaches from a source position, in pixels of the input. The adaptive filter
+gets widened by the footprint of the output pixel in the source (the Jacobian), which is the largest either at
+the rim of the distorted area or in the middle of it. So we take the largest footprint at the corners, the middles
+of the edges and the center of the output bbox and ask the filter how many pixels it covers at that size.
+*/
+void SyLens::update_skip_padding(const Box& obox)
+{
+	double scale = 1;
+	if(k_adaptive_filter_) {
+		const int xs[] = { obox.x(), (obox.x() + obox.r()) / 2, obox.r() };
+		const int ys[] = { obox.y(), (obox.y() + obox.t()) / 2, obox.t() };
+		for(unsigned j = 0; j < 3; j++) {
+			for(unsigned i = 0; i < 3; i++) {
+				Vector2 xy(xs[i] - xShift, ys[j] - yShift), d_dx, d_dy;
+				if(k_output == UNDIST) {
+					distort_px_into_source(xy, d_dx, d_dy);
+				} else {
+					undistort_px_into_destination(xy, d_dx, d_dy);
+				}
+				
+				// The extent of the footprint along X and Y
+				scale = std::max(scale, fabs(d_dx.x) + fabs(d_dy.x));
+				scale = std::max(scale, fabs(d_dx.y) + fabs(d_dy.y));
+			}
+		}
+	}
+	
+	Filter::Coefficients coefficients;
+	filter.get(0.5f, (float)scale, coefficients);
+	double reach = std::max(-coefficients.first, coefficients.first + coefficients.count);
+	skip_padding_ = reach + SKIP_EMPTY_MARGIN;
+}
+
+#ifdef SYLENS_PLANAR
+
+// The image processor that works by stripes. We get a number of rows and all the requested channels,
+// so every pixel gets (un)distorted and sampled once and written into all the channel planes.
+void SyLens::renderStripe(ImagePlane& plane)
+{
+	SY_TRACE_SPAN("SyLens stripe");
+	SyStatsScope stripe_scope(node_stats(), SY_TIME_ENGINE);
+	plane.makeWritable();
+	
+	const Box& box = plane.bounds();
+	const ChannelSet& channels = plane.channels();
+	sy_thread_counters.rows += box.t() - box.y();
+	sy_thread_counters.pixels += (U64)box.w() * box.h();
+	
+	// Resolve where the channels live in the plane once instead of per pixel
+	std::vector<Channel> plane_channels;
+	std::vector<int> plane_indices;
+	foreach(z, channels) {
+		plane_channels.push_back(z);
+		plane_indices.push_back(plane.chanNo(z));
+	}
+	const unsigned num_channels = plane_channels.size();
+	
+	const bool apply_stmap = (k_output == APPLY_STMAP);
+	const ChannelSet map_channels = stmap_input_channels();
+	Row map_row(box.x(), box.r());
+	
+	Pixel pixel(channels);
+	Vector2 source;
+	
+	// The lookups get counted here and added to the thread counters once per stripe
+	SyCounters stripe_counters = SyCounters();
+	for (int y = box.y(); y < box.t(); y++) {
+		if(aborted()) break;
+		
+		if(apply_stmap) {
+			SyStatsPause upstream;
+			input1().get(y, box.x(), box.r(), map_channels, map_row);
+		}
+		
+		int span_x = box.x(), span_r = box.r();
+		if(skip_empty_) clip_row_to_input_bbox(y, span_x, span_r);
+		
+		for (int x = box.x(); x < box.r(); x++) {
+			// Outside of the span there is only black to sample
+			if(x < span_x || x >= span_r) {
+				for (unsigned c = 0; c < num_channels; c++) {
+					plane.writableAt(x, y, plane_indices[c]) = 0.0f;
+				}
+				continue;
+			}
+			
+			if(apply_stmap) {
+				sample_stmap_pixel(x, map_row, pixel, source);
+			} else {
+				sample_output_pixel(x, y, pixel, source, stripe_counters);
+			}
+			add_map_channels(x, y, source, channels, pixel);
+			
+			for (unsigned c = 0; c < num_channels; c++) {
+				plane.writableAt(x, y, plane_indices[c]) = pixel[plane_channels[c]];
+			}
+		}
+	}
+	sy_thread_counters.lut_lookups += stripe_counters.lut_lookups;
+	sy_thread_counters.lut_fallbacks += stripe_counters.lut_fallbacks;
+}
+
+#else
+
+// The image processor that works by scanline. Y is the scanline offset, x is the pix,
+// r is the length of the row. We are now effectively in the undistorted coordinates, mind you!
+void SyLens::engine ( int y, int x, int r, ChannelMask channels, Row& out )
+{
+	SY_TRACE_SPAN("SyLens row");
+	SyStatsScope row_scope(node_stats(), SY_TIME_ENGINE);
+	sy_thread_counters.rows++;
+	sy_thread_counters.pixels += r - x;
+	
+	foreach(z, channels) out.writable(z);
+	
+	const bool apply_stmap = (k_output == APPLY_STMAP);
+	Row map_row(x, r);
+	if(apply_stmap) {
+		SyStatsPause upstream;
+		input1().get(y, x, r, stmap_input_channels(), map_row);
+	}
+	
+	// Outside of the span there is only black to sample, so fill it in directly
+	int span_x = x, span_r = r;
+	if(skip_empty_) clip_row_to_input_bbox(y, span_x, span_r);
+	foreach(z, channels) {
+		float* values = (float*)out[z];
+		for(int i = x; i < span_x; i++) values[i] = 0.0f;
+		for(int i = span_r; i < r; i++) values[i] = 0.0f;
+	}
+	
+	Pixel pixel(channels);
+	Vector2 source;
+	
+	// The lookups get counted here and added to the thread counters once per row
+	SyCounters row_counters = SyCounters();
+	for (x = span_x; x < span_r; x++) {
+		
+		if(apply_stmap) {
+			sample_stmap_pixel(x, map_row, pixel, source);
+		} else {
+			sample_output_pixel(x, y, pixel, source, row_counters);
+		}
+		add_map_channels(x, y, source, channels, pixel);
 		
 		// write the resulting pixel into the image
 		foreach (z, channels)
@@ -279,6 +876,410 @@ void SyLens::engine ( int y, int x, int r, ChannelMask channels, Row& out )
 			((float*)out[z])[x] = pixel[z];
 		}
 	}
+	sy_thread_counters.lut_lookups += row_counters.lut_lookups;
+	sy_thread_counters.lut_fallbacks += row_counters.lut_fallbacks;
+}
+
+#endif
+
+// We only preview while a lens knob is actively being dragged in the GUI
+bool SyLens::previewing()
+{
+	return k_interactive_preview_ && k_preview_state_ == 1;
+}
+
+// Bakes the coarse grid used for previews. Since the drag changes the distortion all the time
+// this gets called a lot, but the grid only has one node per PREVIEW_GRID_SPACING pixels of the full
+// resolution plate. Proxy renders look up the same grid.
+void SyLens::update_preview_grid()
+{
+	Hash grid_hash;
+	grid_hash.append(distorter.compute_hash());
+	grid_hash.append(k_output);
+	grid_hash.append(full_width_);
+	grid_hash.append(full_height_);
+	if(!preview_grid_.empty() && preview_grid_.key() == grid_hash.value()) return;
+	
+	unsigned nx = (unsigned)ceil(full_width_ * PREVIEW_GRID_EXTENT / PREVIEW_GRID_SPACING) + 1;
+	unsigned ny = (unsigned)ceil(full_height_ * PREVIEW_GRID_EXTENT / PREVIEW_GRID_SPACING) + 1;
+	preview_grid_.resize(nx, ny, -PREVIEW_GRID_EXTENT, -PREVIEW_GRID_EXTENT, PREVIEW_GRID_EXTENT, PREVIEW_GRID_EXTENT);
+	
+	if(k_output == UNDIST) {
+		distorter.bake_apply_disto(preview_grid_);
+	} else {
+		distorter.bake_remove_disto(preview_grid_);
+	}
+	preview_grid_.set_key(grid_hash.value());
+}
+
+// Maps the centered UV of an output pixel to the centered UV in the source, with the actual distortion
+bool SyLens::map_uv_exact(Vector2& uv)
+{
+	return map_uv_exact(distorter, k_output, uv);
+}
+
+bool SyLens::map_uv_exact(SyDistorter& lens, int output, Vector2& uv)
+{
+	if(output == UNDIST) {
+		return lens.apply_disto(uv);
+	} else {
+		return lens.remove_disto(uv);
+	}
+}
+
+// Where the lens of our view is centered. apply_disto() with a shift is apply_disto() without
+// one moved by the shift, and remove_disto() is moved by the shift the other way around.
+Vector2 SyLens::lens_center_offset()
+{
+	return lens_center_offset(distorter, k_output);
+}
+
+Vector2 SyLens::lens_center_offset(SyDistorter& lens, int output)
+{
+	if(output == UNDIST) {
+		return Vector2(lens.center_shift_u(), lens.center_shift_v());
+	} else {
+		return Vector2(-lens.center_shift_u(), -lens.center_shift_v());
+	}
+}
+
+// Looks the centered UV up in the fast grid, moving it to the unshifted lens the grid was baked with and back
+bool SyLens::lookup_fast_grid(Vector2& uv)
+{
+	if(!fast_grid_) return false;
+	
+	Vector2 offset = lens_center_offset();
+	Vector2 unshifted(uv.x - offset.x, uv.y - offset.y);
+	if(!fast_grid_->lookup_bicubic(unshifted)) return false;
+	
+	uv.x = unshifted.x + offset.x;
+	uv.y = unshifted.y + offset.y;
+	return true;
+}
+
+/*
+Picks up the grid for the fast mode over the output bbox. If another node or view (or the warm-up)
+already baked a grid for the same lens we just use theirs, otherwise we bake it.
+
+The grid is in Syntheyes coordinates and gets measured in pixels of the full resolution plate, so it
+does not depend on the proxy scale. A proxy render covers the same area of the lens, ends up with the same
+key and looks up the full resolution grid at it's coarser pixels instead of baking one of it's own.
+*/
+void SyLens::update_fast_grid(const Box& obox)
+{
+	SyFastGridSpec spec;
+	spec.output = k_output;
+	spec.tolerance = k_fast_tolerance_;
+	spec.compact = k_compact_grid_;
+	spec.plate_width = plate_width_;
+	spec.plate_height = plate_height_;
+	spec.full_width = full_width_;
+	spec.full_height = full_height_;
+	place_fast_grid(spec, distorter, obox, xShift, yShift);
+	if(fast_grid_ && fast_grid_->key() == spec.key) return;
+	
+	SY_TRACE_SPAN("SyLens fast grid");
+	SyWarpGridCache::release(fast_grid_);
+	fast_grid_ = SyWarpGridCache::acquire(spec.key);
+	if(fast_grid_) {
+		debug("Fast mode grid shared with another node or view");
+		return;
+	}
+	
+	fast_grid_ = SyWarpGridCache::publish(spec.key, bake_fast_grid(distorter, spec, 0));
+	if(fast_grid_->empty()) {
+		debug("Fast mode could not reach the tolerance, using exact distortion");
+	} else {
+		debug("Fast mode grid is %dx%d nodes and takes %d KB", (int)fast_grid_->width(), (int)fast_grid_->height(), (int)(fast_grid_->memory_size() / 1024));
+	}
+}
+
+// Computes the area of the fast grid for the output bbox and the key of the grid into spec
+void SyLens::place_fast_grid(SyFastGridSpec& spec, SyDistorter& lens, const Box& obox, int x_shift, int y_shift)
+{
+	// The area we render, in the coordinates we sample with, moved to the unshifted lens
+	Vector2 offset = lens_center_offset(lens, spec.output);
+	double left = toUv(obox.x() - x_shift, spec.plate_width) - offset.x;
+	double bottom = toUv(obox.y() - y_shift, spec.plate_height) - offset.y;
+	double right = toUv(obox.r() - x_shift, spec.plate_width) - offset.x;
+	double top = toUv(obox.t() - y_shift, spec.plate_height) - offset.y;
+	
+	spec.left = floor(left / FAST_GRID_AREA_QUANTUM) * FAST_GRID_AREA_QUANTUM;
+	spec.bottom = floor(bottom / FAST_GRID_AREA_QUANTUM) * FAST_GRID_AREA_QUANTUM;
+	spec.right = ceil(right / FAST_GRID_AREA_QUANTUM) * FAST_GRID_AREA_QUANTUM;
+	spec.top = ceil(top / FAST_GRID_AREA_QUANTUM) * FAST_GRID_AREA_QUANTUM;
+	
+	// The shift is not in here on purpose
+	Hash grid_hash;
+	grid_hash.append(lens.compute_radial_hash());
+	grid_hash.append(lens.precision());
+	grid_hash.append(spec.output);
+	grid_hash.append(spec.tolerance);
+	grid_hash.append(spec.compact);
+	grid_hash.append(spec.full_width);
+	grid_hash.append(spec.full_height);
+	grid_hash.append(spec.left);
+	grid_hash.append(spec.bottom);
+	grid_hash.append(spec.right);
+	grid_hash.append(spec.top);
+	spec.key = grid_hash.value();
+}
+
+// What the worker threads need for baking and checking the rows of a fast grid, see SyParallel.h
+struct SyFastGridTask
+{
+	SyWarpGrid* baked;
+	const SyWarpGrid* grid;
+	SyDistorter* lens;
+	const SyFastGridSpec* spec;
+	double tolerance;
+	
+	// The largest deviation found on every row of cells
+	std::vector<double> row_errors;
+};
+
+// Rows of grid nodes handed to a worker thread at once
+static const unsigned FAST_GRID_ROWS_PER_CHUNK = 4;
+
+/*
+Bakes the grid for the fast mode. We start with a very coarse grid and keep halving the spacing until
+the bicubically interpolated coordinates stay within the tolerance, so smooth distortions get away with
+a coarse grid and strong ones get a denser one. When even the finest grid is not good enough the grid
+comes back empty, so that the renders use the exact distortion. The warm-up passes it's job and gets 0
+back if the job gets cancelled on the way. Baking and checking run on all the worker threads.
+*/
+SyWarpGrid* SyLens::bake_fast_grid(SyDistorter& source, const SyFastGridSpec& spec, const SyPrewarmJob* job)
+{
+	// The lens of this view without the shift
+	SyDistorter lens;
+	lens.set_model_from(source);
+	lens.set_center_shift(0, 0);
+	
+	// Do not bother with sub-thousandth of a pixel, that is what float precision gives us anyway
+	double tolerance = std::max(0.001, (double)spec.tolerance);
+	
+	// The grid is in the UV coordinates, the spacing is in pixels of the full resolution plate
+	double width_px = (spec.right - spec.left) * (spec.full_width - 1.0) / 2.0;
+	double height_px = (spec.top - spec.bottom) * (spec.full_height - 1.0) / 2.0;
+	
+	SyWarpGrid* grid = new SyWarpGrid;
+	for(unsigned spacing = FAST_GRID_MAX_SPACING; spacing >= FAST_GRID_MIN_SPACING; spacing /= 2) {
+		if(job && job->cancelled()) {
+			delete grid;
+			return 0;
+		}
+		
+		unsigned nx = (unsigned)(width_px / spacing) + 2;
+		unsigned ny = (unsigned)(height_px / spacing) + 2;
+		if((double)nx * ny > FAST_GRID_MAX_NODES) break;
+		
+		grid->resize(nx, ny, spec.left, spec.bottom, spec.right, spec.top);
+		SyFastGridTask task;
+		task.baked = grid;
+		task.grid = grid;
+		task.lens = &lens;
+		task.spec = &spec;
+		task.tolerance = tolerance;
+		SyParallel::run(std::vector<unsigned>(1, ny), bake_fast_grid_rows, &task, FAST_GRID_ROWS_PER_CHUNK);
+		
+		// Compacting before measuring means the error includes the precision loss of the half floats
+		if(spec.compact) grid->compact();
+		
+		if(fast_grid_error_px(*grid, lens, spec, tolerance) <= tolerance) return grid;
+	}
+	
+	// We still share the empty grid so that the other views do not try again
+	grid->clear();
+	return grid;
+}
+
+void SyLens::bake_fast_grid_rows(unsigned job, unsigned begin, unsigned end, void* userdata)
+{
+	SyFastGridTask* task = (SyFastGridTask*)userdata;
+	for(unsigned j = begin; j < end; j++) {
+		for(unsigned i = 0; i < task->baked->width(); i++) {
+			Vector2 pt = task->baked->node_position(i, j);
+			map_uv_exact(*task->lens, task->spec->output, pt);
+			task->baked->set(i, j, pt);
+		}
+	}
+}
+
+// Compares the interpolated and the exact coordinates at a few points within every cell
+// of the fast grid and returns the largest deviation in full resolution pixels. This is a sampled estimate,
+// the deviation between the probes can be somewhat larger. The rows of cells get checked on all the worker
+// threads, every row stops as soon as it's deviation exceeds the tolerance since we are going to refine the grid anyway.
+double SyLens::fast_grid_error_px(const SyWarpGrid& grid, SyDistorter& lens, const SyFastGridSpec& spec, double tolerance)
+{
+	if(grid.height() < 2) return 0;
+	
+	SyFastGridTask task;
+	task.baked = 0;
+	task.grid = &grid;
+	task.lens = &lens;
+	task.spec = &spec;
+	task.tolerance = tolerance;
+	task.row_errors.resize(grid.height() - 1, 0);
+	SyParallel::run(std::vector<unsigned>(1, grid.height() - 1), fast_grid_error_rows, &task, FAST_GRID_ROWS_PER_CHUNK);
+	
+	return *std::max_element(task.row_errors.begin(), task.row_errors.end());
+}
+
+void SyLens::fast_grid_error_rows(unsigned job, unsigned begin, unsigned end, void* userdata)
+{
+	// Where to probe within a cell - the center, the middle of two edges and two diagonal points
+	static const double probes[][2] = { {0.5, 0.5}, {0.5, 0.0}, {0.0, 0.5}, {0.25, 0.25}, {0.75, 0.75} };
+	const unsigned num_probes = sizeof(probes) / sizeof(probes[0]);
+	
+	SyFastGridTask* task = (SyFastGridTask*)userdata;
+	const SyWarpGrid& grid = *task->grid;
+	const double px_per_uv_x = (task->spec->full_width - 1.0) / 2.0;
+	const double px_per_uv_y = (task->spec->full_height - 1.0) / 2.0;
+	
+	for(unsigned j = begin; j < end; j++) {
+		double max_error = 0;
+		for(unsigned i = 0; i + 1 < grid.width() && max_error <= task->tolerance; i++) {
+			Vector2 cell_min = grid.node_position(i, j);
+			Vector2 cell_max = grid.node_position(i + 1, j + 1);
+			
+			for(unsigned p = 0; p < num_probes; p++) {
+				Vector2 exact(
+					cell_min.x + (cell_max.x - cell_min.x) * probes[p][0],
+					cell_min.y + (cell_max.y - cell_min.y) * probes[p][1]
+				);
+				Vector2 interpolated = exact;
+				map_uv_exact(*task->lens, task->spec->output, exact);
+				grid.lookup_bicubic(interpolated);
+				
+				double error = std::max(
+					fabs(exact.x - interpolated.x) * px_per_uv_x,
+					fabs(exact.y - interpolated.y) * px_per_uv_y
+				);
+				max_error = std::max(max_error, error);
+			}
+		}
+		task->row_errors[j] = max_error;
+	}
+}
+
+// With the grown format the output moves by the amount the lower left corner of the plate
+// gets pushed outwards. Returns false if it does not get pushed outwards, then the format stays.
+bool SyLens::grow_shift(SyDistorter& lens, unsigned plate_w, unsigned plate_h, int& x_shift, int& y_shift)
+{
+	Vector2 corner(0,0);
+	absolute_px_to_centered_uv(corner, plate_w, plate_h);
+	lens.remove_disto(corner);
+	centered_uv_to_absolute_px(corner, plate_w, plate_h);
+	if(corner.x >= 0.0f && corner.y >= 0.0f) return false;
+	
+	x_shift = (signed)fabs(corner.x);
+	y_shift = (signed)fabs(corner.y);
+	return true;
+}
+
+void SyLensPrewarmJob::run()
+{
+	lens.set_aspect(aspect);
+	if(!fast || cancelled()) return;
+	
+	// The same steps as in _validate()
+	int x_shift = 0, y_shift = 0;
+	Box obox = SyLens::bbox_with_distortion(lens, spec.plate_width, spec.plate_height, input_box, spec.plate_width, spec.plate_height, spec.output);
+	if(grow && spec.output == SyLens::UNDIST && SyLens::grow_shift(lens, spec.plate_width, spec.plate_height, x_shift, y_shift)) {
+		obox.move(x_shift, y_shift);
+	}
+	SyLens::place_fast_grid(spec, lens, obox, x_shift, y_shift);
+	
+	grid = SyWarpGridCache::acquire(spec.key);
+	if(grid) return;
+	
+	SyWarpGrid* baked = SyLens::bake_fast_grid(lens, spec, this);
+	if(baked) grid = SyWarpGridCache::publish(spec.key, baked);
+}
+
+// The stats are kept by the first instance of the node, the one that has the panel
+SyStats& SyLens::node_stats()
+{
+	return static_cast<SyLens*>(firstOp())->stats_;
+}
+
+void SyLens::show_stats()
+{
+	knob("stats_report")->set_text(node_stats().report().c_str());
+}
+
+// Dragging one of the lens knobs switches to the preview. The preview state is a hidden knob
+// so that the previewed and the refined images end up with different hashes in the cache.
+int SyLens::knob_changed(Knob* k)
+{
+	if(k->is("showPanel")) distorter.update_knobs(this);
+	if(k->is("update_stats") || k->is("showPanel")) {
+		show_stats();
+		return 1;
+	}
+	if(k->is("reset_stats")) {
+		node_stats().reset();
+		show_stats();
+		return 1;
+	}
+	if(SyPrewarm::is_prewarm_knob(k)) {
+		prewarm();
+		return 1;
+	}
+	if(distorter.is_lens_knob(k)) {
+		distorter.update_knobs(this);
+		SyPrewarm::cancel(firstOp());
+		last_lens_change_ = sy_clock();
+		if(k_interactive_preview_ && k_preview_state_ == 0) {
+			knob("preview_state")->set_value(1);
+		}
+		
+		// There is no signal for the end of the drag, so we make sure updateUI() gets to check for it
+		if(k_preview_state_ == 1) asapUpdate();
+		return 1;
+	}
+	return SyLensBase::knob_changed(k);
+}
+
+// Hands the LUT and the fast grid to the warm-up thread, see SyPrewarm.h. Everything _validate() would
+// take from the input gets taken here and the job does the rest.
+void SyLens::prewarm()
+{
+	SyPrewarm::cancel(firstOp());
+	if(k_output == APPLY_STMAP || !input0().tryValidate(false)) return;
+	
+	const Format& f = input0().format();
+	const Format& full = input0().full_size_format();
+	
+	SyLensPrewarmJob* job = new SyLensPrewarmJob;
+	job->lens.copy_model_from(distorter);
+	job->aspect = float(round(full.width())) / float(round(full.height())) *  full.pixel_aspect();
+	job->fast = k_fast_ && !k_adaptive_filter_;
+	job->grow = k_grow_format_;
+	job->input_box = input0().info();
+	job->spec.output = k_output;
+	job->spec.tolerance = k_fast_tolerance_;
+	job->spec.compact = k_compact_grid_;
+	job->spec.plate_width = round(f.width());
+	job->spec.plate_height = round(f.height());
+	job->spec.full_width = round(full.width());
+	job->spec.full_height = round(full.height());
+	SyPrewarm::schedule(firstOp(), job);
+}
+
+// Called on the main thread. Once the lens knobs have not been touched for a little while we consider
+// the drag finished and switch back to the exact render. Until then we ask to be called again, since
+// Nuke does not call updateUI() by itself when nothing changes.
+bool SyLens::updateUI(const OutputContext& context)
+{
+	if(k_preview_state_ == 1) {
+		if((sy_clock() - last_lens_change_) > DRAG_SETTLE_TIME) {
+			knob("preview_state")->set_value(0);
+		} else {
+			asapUpdate();
+		}
+	}
+	return true;
 }
 
 // knobs. There is really only one thing to pay attention to - be consistent and call your knobs
@@ -295,8 +1296,15 @@ void SyLens::knobs( Knob_Callback f) {
 	hidden_mode->set_flag(Knob::DO_NOT_WRITE);
 	
 	distorter.knobs(f);
+	distorter.precision_knob(f);
 	filter.knobs(f);
 	
+	Knob* kAdaptiveKnob = Bool_knob( f, &k_adaptive_filter_, "adaptive_filter");
+	kAdaptiveKnob->label("adaptive filter");
+	kAdaptiveKnob->tooltip("When checked, SyLens will size the filter for every pixel according to how much the "
+		"distortion squeezes or stretches the image there. This removes aliasing at the edges of strongly "
+		"distorted images without having to supersample the whole frame.");
+	
 	// Utility functions
 	Knob* kTrimKnob = Bool_knob( f, &k_trim_bbox_to_format_, "trim");
 	kTrimKnob->label("trim bbox");
@@ -310,11 +1318,78 @@ void SyLens::knobs( Knob_Callback f) {
 		"\nThis is useful if you are going to do a matte painting on the output.");
 	kGrowKnob->set_flag(Knob::STARTLINE);
 	
+	Knob* kFastKnob = Bool_knob( f, &k_fast_, "fast");
+	kFastKnob->label("fast mode");
+	kFastKnob->tooltip("When checked, SyLens computes the exact distortion only on a grid and interpolates "
+		"the coordinates in between. The grid gets as dense as needed to stay within the tolerance, "
+		"as measured at a few points in every cell of the grid. "
+		"Has no effect with adaptive filter enabled.");
+	kFastKnob->set_flag(Knob::STARTLINE);
+	
+	Knob* kToleranceKnob = Float_knob( f, &k_fast_tolerance_, "tolerance");
+	kToleranceKnob->label("tolerance");
+	kToleranceKnob->tooltip("The deviation from the exact distortion allowed in fast mode, in pixels");
+	kToleranceKnob->set_range(0.001f, 0.5f, false);
+	kToleranceKnob->clear_flag(Knob::STARTLINE);
+	
+	Knob* kCompactKnob = Bool_knob( f, &k_compact_grid_, "compact_grid");
+	kCompactKnob->label("compact grid");
+	kCompactKnob->tooltip("Store the fast mode grid in half floats, which takes about half the memory. "
+		"The precision loss is a few thousandths of a pixel at most and counts towards the tolerance.");
+	kCompactKnob->clear_flag(Knob::STARTLINE);
+	
+	Knob* kPreviewKnob = Bool_knob( f, &k_interactive_preview_, "interactive_preview");
+	kPreviewKnob->label("fast preview while dragging");
+	kPreviewKnob->tooltip("When checked, dragging the lens controls renders a quick approximation "
+		"which gets replaced by the exact result as soon as you let go of the control.");
+	kPreviewKnob->set_flag(Knob::STARTLINE);
+	
+	Knob* kPreviewStateKnob = Int_knob( f, &k_preview_state_, "preview_state");
+	kPreviewStateKnob->set_flag(Knob::INVISIBLE);
+	kPreviewStateKnob->set_flag(Knob::DO_NOT_WRITE);
+	kPreviewStateKnob->set_flag(Knob::NO_UNDO);
+	kPreviewStateKnob->set_flag(Knob::NO_ANIMATION);
+	
+	SyPrewarm::knobs(f, &k_prewarm_);
+	
+	Divider(f, 0);
+	
+	// ST map output and input
+	Knob* kStmapKnob = Channel_knob( f, k_stmap_channels_, 2, "stmap_channels");
+	kStmapKnob->label("st map");
+	kStmapKnob->tooltip("Write the position every pixel got sampled from into these channels, as an ST map "
+		"normalized to the input format. Feed it to an STMap node (or to SyLens in \"apply st map\" mode) "
+		"to warp other images the same way without computing the distortion again.");
+	
+	Knob* kJacobianKnob = Channel_knob( f, k_jacobian_channels_, 4, "jacobian_channels");
+	kJacobianKnob->label("jacobian");
+	kJacobianKnob->tooltip("Write the derivatives of the source position in pixels (ds/dx, dt/dx, ds/dy, dt/dy) "
+		"into these channels, for filtering the warp downstream. Not available in \"apply st map\" mode.");
+	
+	Knob* kStmapInputKnob = Input_Channel_knob( f, k_stmap_input_channels_, 2, 1, "stmap_input_channels");
+	kStmapInputKnob->label("st map input");
+	kStmapInputKnob->tooltip("The channels of the stmap input that hold the ST map, used in the \"apply st map\" mode");
+	
 	Divider(f, 0);
 	
 	std::ostringstream ver;
 	ver << "SyLens v." << VERSION;
 	Text_knob(f, ver.str().c_str());
+	
+	// Read-only performance counters. Changing the text must not cause a rerender.
+	Tab_knob(f, "stats");
+	Knob* kStatsKnob = Multiline_String_knob(f, &k_stats_text_, "stats_report", "stats", 12);
+	kStatsKnob->set_flag(Knob::DISABLED);
+	kStatsKnob->set_flag(Knob::DO_NOT_WRITE);
+	kStatsKnob->set_flag(Knob::NO_RERENDER);
+	kStatsKnob->set_flag(Knob::NO_UNDO);
+	kStatsKnob->set_flag(Knob::NO_ANIMATION);
+	
+	Knob* kUpdateStatsKnob = Button(f, "update_stats", "update");
+	kUpdateStatsKnob->tooltip("Show the current counters");
+	kUpdateStatsKnob->set_flag(Knob::STARTLINE);
+	Knob* kResetStatsKnob = Button(f, "reset_stats", "reset");
+	kResetStatsKnob->tooltip("Set all the counters back to zero");
 }
 
 // http://stackoverflow.com/questions/485525/round-for-float-in-c
@@ -330,32 +1405,23 @@ void SyLens::_computeAspects() {
 	
 	plate_width_ = round(f.width());
 	plate_height_ = round(f.height());
-
-	_aspect = float(plate_width_) / float(plate_height_) *  f.pixel_aspect();
+	
+	// The aspect comes from the full size format. The proxy one is rounded to whole pixels and would
+	// give a slightly different aspect, and with it a different distortion and a LUT of it's own.
+	const Format& full = input0().full_size_format();
+	full_width_ = round(full.width());
+	full_height_ = round(full.height());
+	
+	_aspect = float(full_width_) / float(full_height_) *  full.pixel_aspect();
 	
 	debug("true plate window with uncrop will be %dx%d", plate_width_, plate_height_);
 }
 
 
-// Here we need to expand the image and the bounding box. This is the most important method in a plug like this so
-// pay attention
-void SyLens::_validate(bool for_real)
+// Computes the bbox, the shifts and the output format for the input bbox. The
+// lens has to be recomputed already.
+Box SyLens::compute_output_geometry(Info& inf)
 {
-	// Bookkeeping boilerplate
-	filter.initialize();
-	input0().validate(for_real);
-	copy_info();
-	set_out_channels(Mask_All);
-	
-	// Do not blank away everything
-	info_.black_outside(false);
-	
-	// We need to know our aspects so prep them here
-	_computeAspects();
-	
-	distorter.set_aspect(_aspect);
-	distorter.recompute_if_needed();
-	
 	// Reset pixel shifts to 0 for the case
 	// that the grow plate has been disabled
 	xShift = 0;
@@ -369,7 +1435,6 @@ void SyLens::_validate(bool for_real)
 	// corner we want to actually translate the bbox of the elephant to our distorted pipe downstream. So we need to
 	// apply our SuperAlgorizm to the bbox as well and move the bbox downstream too.
 	// Grab the bbox from the input first
-	Info inf = input0().info();
 	debug("Input bbox is %dx%d to %dx%d", inf.x(), inf.y(), inf.r(), inf.t());
 	
 	Box obox = compute_needed_bbox_with_distortion(inf, plate_width_, plate_height_, k_output);
@@ -386,15 +1451,9 @@ void SyLens::_validate(bool for_real)
 		// new oversize format. We need to store this format as a member to prevent Nuke from
 		// crashing (otherwise the Format object goes out of scope and the _validate() of the
 		// downstream node cannot get at it) 
-		Vector2 corner(0,0);
-		undistort_px_into_destination(corner);
-		
 		// If we undistort and the corner will end up outside - we have overflow
-		if(corner.x < 0.0f || corner.y < 0.0f) {
-			debug("Barrel distortion and plate needs to grow. Off-corner is %0.5fx%0.5f", corner.x, corner.y);
-			
-			xShift = (signed)fabs(corner.x);
-			yShift = (signed)fabs(corner.y);
+		if(grow_shift(distorter, plate_width_, plate_height_, xShift, yShift)) {
+			debug("Barrel distortion and plate needs to grow. Off-corner is %dx%d", -xShift, -yShift);
 			
 			// Reassign the output format to something bigger than the original
 			output_format = Format(output_format.width() + (xShift * 2), output_format.height() + (yShift * 2), output_format.pixel_aspect());
@@ -407,6 +1466,105 @@ void SyLens::_validate(bool for_real)
 		}
 	}
 	
+	return obox;
+}
+
+// Here we need to expand the image and the bounding box. This is the most important method in a plug like this so
+// pay attention
+void SyLens::_validate(bool for_real)
+{
+	SY_TRACE_SPAN("SyLens validate");
+	SyStatsScope validate_scope(node_stats(), SY_TIME_VALIDATE);
+	node_stats().set_name(node_name());
+	
+	// Bookkeeping boilerplate
+	filter.initialize();
+	{
+		SyStatsPause upstream;
+		input0().validate(for_real);
+	}
+	copy_info();
+	set_out_channels(Mask_All);
+	
+	// Do not blank away everything
+	info_.black_outside(false);
+	
+	// We need to know our aspects so prep them here
+	_computeAspects();
+	
+	// The ST map and Jacobian outputs come on top of the channels of the input
+	map_channels_.clear();
+	for(unsigned i = 0; i < 2; i++) {
+		if(k_stmap_channels_[i] != Chan_Black) map_channels_ += k_stmap_channels_[i];
+	}
+	for(unsigned i = 0; i < 4; i++) {
+		if(k_jacobian_channels_[i] != Chan_Black) map_channels_ += k_jacobian_channels_[i];
+	}
+	info_.turn_on(map_channels_);
+	
+	// Pixels that sample outside of a black_outside input are black, unless they also carry the ST map
+	skip_empty_ = input0().info().black_outside() && k_output != APPLY_STMAP && map_channels_.empty();
+	
+	// With a precomputed ST map the output is simply where the map is, and there is no distortion to compute
+	if(k_output == APPLY_STMAP) {
+		xShift = 0;
+		yShift = 0;
+		validated_key_ = 0;
+		{
+			SyStatsPause upstream;
+			input1().validate(for_real);
+		}
+		output_format = input1().format();
+		info_.format(output_format);
+		info_.set(input1().info());
+		SyPrewarm::cancel(firstOp());
+		return;
+	}
+	
+	if(distorter.set_aspect(_aspect)) sy_thread_counters.lut_rebuilds++;
+	
+	preview_filter_.initialize();
+	if(previewing()) update_preview_grid();
+	
+	// Everything the bbox, the shifts and the output format depend on
+	Info inf = input0().info();
+	const Format& input_format = input0().format();
+	Hash geometry_hash;
+	geometry_hash.append(distorter.compute_hash());
+	geometry_hash.append(k_output);
+	geometry_hash.append(k_grow_format_);
+	geometry_hash.append(plate_width_);
+	geometry_hash.append(plate_height_);
+	geometry_hash.append(full_width_);
+	geometry_hash.append(full_height_);
+	geometry_hash.append(input_format.x());
+	geometry_hash.append(input_format.y());
+	geometry_hash.append(input_format.r());
+	geometry_hash.append(input_format.t());
+	geometry_hash.append(input_format.pixel_aspect());
+	geometry_hash.append(inf.x());
+	geometry_hash.append(inf.y());
+	geometry_hash.append(inf.r());
+	geometry_hash.append(inf.t());
+	
+	Box obox;
+	if(geometry_hash.value() == validated_key_) {
+		obox = validated_obox_;
+	} else {
+		obox = compute_output_geometry(inf);
+		validated_key_ = geometry_hash.value();
+		validated_obox_ = obox;
+	}
+	
+	if(k_fast_ && !k_adaptive_filter_) {
+		update_fast_grid(obox);
+	} else if(fast_grid_) {
+		SyWarpGridCache::release(fast_grid_);
+		fast_grid_ = 0;
+	}
+	
+	if(skip_empty_) update_skip_padding(obox);
+	
 	// If trim is enabled we intersect our obox with the format so that there is no bounding box
 	// outside the crop area. Thiis handy for redistorted material.
 	if(k_trim_bbox_to_format_) obox.intersect(output_format);
@@ -416,13 +1574,32 @@ void SyLens::_validate(bool for_real)
 	// Set the oversize format and the bounding box
 	info_.format(output_format);
 	info_.set(obox);
+	
+	// We hold on to the tables ourselves now
+	SyPrewarm::cancel(firstOp());
 }
 
 void SyLens::_request(int x, int y, int r, int t, ChannelMask channels, int count)
 {
+	SY_TRACE_SPAN("SyLens request");
+	SyStatsScope request_scope(node_stats(), SY_TIME_REQUEST);
 	ChannelSet c1(channels); in_channels(0,c1);
 	
 	debug("Received request from downstream [%d,%d]x [%d,%d]", x, y, r, t);
+	sy_thread_counters.requests++;
+	sy_thread_counters.requested_area += (double)(r - x) * (t - y);
+	
+	// The map can point anywhere in the input so we need all of it
+	if(k_output == APPLY_STMAP) {
+		const Info& src = input0().info();
+		{
+			SyStatsPause upstream;
+			input1().request(x, y, r, t, stmap_input_channels(), count);
+			input0().request(src.x(), src.y(), src.r(), src.t(), channels, count);
+		}
+		sy_thread_counters.upstream_area += (double)src.w() * src.h();
+		return;
+	}
 
 	const signed safetyPadding = 4;
 	Box requested(x, y, r, t);
@@ -430,7 +1607,7 @@ void SyLens::_request(int x, int y, int r, int t, ChannelMask channels, int coun
 	requested.pad(safetyPadding);
 	
 	// Request the same part of the input, but without distortions
-	Box disto_requested = compute_needed_bbox_with_distortion(requested, out_width_, out_height_, UNDIST);
+	Box disto_requested = compute_needed_bbox_with_distortion(requested, plate_width_, plate_height_, UNDIST);
 
 	debug("Will request upstream (accounting for (re)distortion): [%d,%d] by [%d,%d]", 
 		disto_requested.x(),
@@ -438,7 +1615,9 @@ void SyLens::_request(int x, int y, int r, int t, ChannelMask channels, int coun
 		disto_requested.r(),
 		disto_requested.t()
 	);
+	sy_thread_counters.upstream_area += (double)disto_requested.w() * disto_requested.h();
 	
+	SyStatsPause upstream;
 	input0().request(
 		disto_requested.x(),
 		disto_requested.y(),
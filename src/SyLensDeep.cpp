@@ -0,0 +1,459 @@
+/*
+	SyLensDeep removes or applies the Syntheyes lens distortion on deep images, so that deep renders
+	can be matched to the plate without flattening them first.
+
+	Deep samples can not be filtered like pixels, so instead of sampling the input we move whole
+	sample lists around. The source position gets computed once per output pixel and every sample
+	of the pixels around it is taken over from there, the distortion is never computed per sample.
+	The output is rendered row by row and every row only pulls the part of the input it samples from,
+	so heavy volumetric renders do not need to be in memory all at once.
+*/
+
+// For max/min on containers
+#include <algorithm>
+
+// For string concats
+#include <sstream>
+
+#include "DDImage/DeepFilterOp.h"
+#include "DDImage/DeepPlane.h"
+#include "DDImage/Knobs.h"
+#include "SyDistorter.cpp"
+#include "SyStats.cpp"
+#include "SyPrewarm.cpp"
+
+using namespace DD::Image;
+
+static const char* const CLASS = "SyLensDeep";
+static const char* const HELP =  "This plugin undistorts deep images according "
+	"to the lens distortion model used by Syntheyes. "
+	"Contact me@julik.nl if you need help with the plugin.";
+
+#include "VERSION.h"
+
+static const char* const output_mode_names[] = { "remove disto", "apply disto", 0 };
+static const char* const sampling_names[] = { "nearest", "weighted", 0 };
+
+// With weighted sampling, samples of the neighbouring pixels whose depths differ by less than this
+// (relative to the depth) are taken to be the same surface and blend into one sample
+static const float SAMPLE_DEPTH_TOLERANCE = 0.01f;
+
+// The samples of the four pixels the weighted sampling blends, merged by depth. Per sample there is
+// the sum of the weights, the weighted depths and the weighted values of all the channels in the order
+// of the channel set, plus the last neighbour that added to it.
+struct SyMergedSamples
+{
+	unsigned num_channels;
+	std::vector<float> weight, front, back, values;
+	std::vector<unsigned> neighbour;
+	
+	void clear()
+	{
+		weight.clear();
+		front.clear();
+		back.clear();
+		values.clear();
+		neighbour.clear();
+	}
+};
+
+class SyLensDeep : public DeepFilterOp
+{
+	//Nuke statics
+
+	const char* Class() const { return CLASS; }
+	const char* node_help() const { return HELP; }
+	static const Op::Description description;
+
+	enum { UNDIST, REDIST };
+
+	// Take the samples of the pixel the source position falls into, or of the four pixels
+	// around it with the sample values scaled by the bilinear weights and merged by depth
+	enum { NEAREST, WEIGHTED };
+
+	// The size of the plate that we distort
+	unsigned int plate_width_, plate_height_;
+
+	int k_output, k_sampling_;
+
+	// Bumped by sylens.py to ask for a warm-up, see SyPrewarm.h
+	int k_prewarm_;
+
+	// The distortion engine
+	SyDistorter distorter;
+
+public:
+	SyLensDeep( Node *node ) : DeepFilterOp ( node )
+	{
+		k_output = UNDIST;
+		k_sampling_ = NEAREST;
+		plate_width_ = 0;
+		plate_height_ = 0;
+		k_prewarm_ = 0;
+	}
+
+	~SyLensDeep()
+	{
+		SyPrewarm::cancel(this);
+	}
+
+	Op* op() { return this; }
+
+	void _validate(bool for_real);
+	void getDeepRequests(Box box, const ChannelSet& channels, int count, std::vector<RequestData>& requests);
+	bool doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& plane);
+	void knobs( Knob_Callback f);
+	int knob_changed(Knob* k);
+
+	// Hashing for caches. We append our version to the cache hash, so that when you update
+	// the plugin all the caches will be flushed automatically
+	void append(Hash& hash) {
+		hash.append(VERSION);
+		hash.append(distorter.compute_hash());
+		hash.append(k_output);
+		hash.append(k_sampling_);
+		DeepFilterOp::append(hash); // the super called he wants his pointers back
+	}
+
+private:
+	double toUv(double, int);
+	double fromUv(double, int);
+	void map_row_to_source(int y, int x, int r, std::vector<Vector2>& sources);
+	void map_px(Vector2& xy, bool to_output);
+	Box map_bounds(const Box& box, bool to_output);
+	void add_samples(const DeepPixel& pixel, const ChannelSet& channels, float weight, DeepOutPixel& out);
+	void merge_samples(const DeepPixel& pixel, const ChannelSet& channels, float weight, unsigned neighbour,
+		SyMergedSamples& merged);
+	void add_merged_samples(const SyMergedSamples& merged, const ChannelSet& channels, DeepOutPixel& out);
+};
+
+static Op* SyLensDeepCreate( Node* node ) {
+	return new SyLensDeep(node);
+}
+
+const Op::Description SyLensDeep::description(CLASS, "Deep/SyLensDeep", SyLensDeepCreate);
+
+// Syntheyes UV coordinates start at the optical center of the image and go -1,1.
+// Same conversions as SyLens uses.
+double SyLensDeep::toUv(double absValue, int absSide)
+{
+  return (((absValue - 0.5f) / (absSide - 1.0f)) - 0.5f) * 2.0f;
+}
+
+double SyLensDeep::fromUv(double uvValue, int absSide)
+{
+  return (((uvValue / 2.0f) + 0.5f) * (absSide - 1.0f)) + 0.5f;
+}
+
+// Moves a pixel position from the output to the source or the other way around
+void SyLensDeep::map_px(Vector2& xy, bool to_output)
+{
+	xy.x = toUv(xy.x, plate_width_);
+	xy.y = toUv(xy.y, plate_height_);
+	if((k_output == UNDIST) != to_output) {
+		distorter.apply_disto(xy);
+	} else {
+		distorter.remove_disto(xy);
+	}
+	xy.x = fromUv(xy.x, plate_width_);
+	xy.y = fromUv(xy.y, plate_height_);
+}
+
+// Where the pixels x to r of the output row y sample from in the input. The whole row
+// goes through the batch distortion in one go.
+void SyLensDeep::map_row_to_source(int y, int x, int r, std::vector<Vector2>& sources)
+{
+	sources.resize(r - x);
+	for(int i = x; i < r; i++) {
+		sources[i - x] = Vector2(toUv(i, plate_width_), toUv(y, plate_height_));
+	}
+
+	if(k_output == UNDIST) {
+		distorter.apply_disto(&sources[0], sources.size());
+	} else {
+		distorter.remove_disto(&sources[0], sources.size());
+	}
+
+	for(unsigned i = 0; i < sources.size(); i++) {
+		sources[i].x = fromUv(sources[i].x, plate_width_);
+		sources[i].y = fromUv(sources[i].y, plate_height_);
+	}
+}
+
+/*
+Pushes the edges of the box through the mapping and returns the bounding box of the result.
+Like in SyCompose we walk the edges in small steps, so that the bulge of the edges at the
+centerlines gets caught as well.
+*/
+Box SyLensDeep::map_bounds(const Box& box, bool to_output)
+{
+	const unsigned steps_per_edge = 32;
+
+	float minX = 0, minY = 0, maxX = 0, maxY = 0;
+	for(unsigned i = 0; i <= steps_per_edge; i++) {
+		double t = double(i) / steps_per_edge;
+		float x = box.x() + (box.r() - box.x()) * t;
+		float y = box.y() + (box.t() - box.y()) * t;
+		Vector2 points[4] = { Vector2(x, box.y()), Vector2(x, box.t()), Vector2(box.x(), y), Vector2(box.r(), y) };
+
+		for(unsigned p = 0; p < 4; p++) {
+			map_px(points[p], to_output);
+			if(i == 0 && p == 0) {
+				minX = maxX = points[p].x;
+				minY = maxY = points[p].y;
+			} else {
+				minX = std::min(minX, points[p].x);
+				maxX = std::max(maxX, points[p].x);
+				minY = std::min(minY, points[p].y);
+				maxY = std::max(maxY, points[p].y);
+			}
+		}
+	}
+
+	return Box((int)floor(minX), (int)floor(minY), (int)ceil(maxX), (int)ceil(maxY));
+}
+
+void SyLensDeep::_validate(bool for_real)
+{
+	SY_TRACE_SPAN("SyLensDeep validate");
+
+	// Validates the input and copies it's deep info
+	DeepFilterOp::_validate(for_real);
+	if(!input0()) return;
+
+	// The algo works in image aspect, not the pixel aspect. Like SyLens we take it from the
+	// full size format, so that proxy renders use the same lens
+	const Format& f = *_deepInfo.format();
+	plate_width_ = f.width();
+	plate_height_ = f.height();
+	const Format& full = *_deepInfo.formats().fullSizeFormat();
+	double aspect = float(full.width()) / float(full.height()) *  full.pixel_aspect();
+
+	distorter.set_aspect(aspect);
+	distorter.recompute_if_needed();
+
+	Box obox = map_bounds(input0()->deepInfo().box(), true);
+	_deepInfo = DeepInfo(_deepInfo.formats(), obox, _deepInfo.channels());
+
+	// We hold on to the LUT ourselves now
+	SyPrewarm::cancel(firstOp());
+}
+
+void SyLensDeep::getDeepRequests(Box box, const ChannelSet& channels, int count, std::vector<RequestData>& requests)
+{
+	SY_TRACE_SPAN("SyLensDeep request");
+	if(!input0()) return;
+
+	// The weighted sampling reaches one pixel further than the source position
+	Box needed = map_bounds(box, false);
+	needed.pad(1);
+	needed.intersect(input0()->deepInfo().box());
+
+	ChannelSet get_channels = channels;
+	get_channels += Mask_Deep;
+	requests.push_back(RequestData(input0(), needed, get_channels, count));
+}
+
+// Appends every sample of the pixel to the output pixel. The depth stays as it is, everything
+// else gets scaled by the weight, which is fine since deep samples are premultiplied.
+void SyLensDeep::add_samples(const DeepPixel& pixel, const ChannelSet& channels, float weight, DeepOutPixel& out)
+{
+	const unsigned num_samples = pixel.getSampleCount();
+	for(unsigned s = 0; s < num_samples; s++) {
+		foreach(z, channels) {
+			float value = pixel.getUnorderedSample(s, z);
+			if(z != Chan_DeepFront && z != Chan_DeepBack) value *= weight;
+			out.push_back(value);
+		}
+	}
+}
+
+static bool same_depth(float a, float b)
+{
+	return fabs(a - b) <= SAMPLE_DEPTH_TOLERANCE * std::max(fabs(a), fabs(b));
+}
+
+/*
+Adds the samples of one of the four pixels around the source position, scaled by it's weight. A sample at the
+same depth as one of another pixel is the same surface seen through both, so it gets added to that one - otherwise
+the pixels would cover each other and an opaque surface would come out partly transparent once flattened.
+*/
+void SyLensDeep::merge_samples(const DeepPixel& pixel, const ChannelSet& channels, float weight, unsigned neighbour,
+	SyMergedSamples& merged)
+{
+	const unsigned num_samples = pixel.getSampleCount();
+	for(unsigned s = 0; s < num_samples; s++) {
+		const float front = pixel.getUnorderedSample(s, Chan_DeepFront);
+		const float back = pixel.getUnorderedSample(s, Chan_DeepBack);
+		
+		unsigned m = 0;
+		for(; m < merged.weight.size(); m++) {
+			if(merged.neighbour[m] == neighbour) continue;
+			if(same_depth(merged.front[m] / merged.weight[m], front)
+				&& same_depth(merged.back[m] / merged.weight[m], back)) break;
+		}
+		if(m == merged.weight.size()) {
+			merged.weight.push_back(0.0f);
+			merged.front.push_back(0.0f);
+			merged.back.push_back(0.0f);
+			merged.neighbour.push_back(neighbour);
+			merged.values.resize(merged.values.size() + merged.num_channels, 0.0f);
+		}
+		
+		merged.neighbour[m] = neighbour;
+		merged.weight[m] += weight;
+		merged.front[m] += front * weight;
+		merged.back[m] += back * weight;
+		float* values = &merged.values[m * merged.num_channels];
+		unsigned c = 0;
+		foreach(z, channels) {
+			values[c++] += pixel.getUnorderedSample(s, z) * weight;
+		}
+	}
+}
+
+// Appends the merged samples to the output pixel, at their weighted average depth
+void SyLensDeep::add_merged_samples(const SyMergedSamples& merged, const ChannelSet& channels, DeepOutPixel& out)
+{
+	for(unsigned m = 0; m < merged.weight.size(); m++) {
+		const float* values = &merged.values[m * merged.num_channels];
+		unsigned c = 0;
+		foreach(z, channels) {
+			if(z == Chan_DeepFront) {
+				out.push_back(merged.front[m] / merged.weight[m]);
+			} else if(z == Chan_DeepBack) {
+				out.push_back(merged.back[m] / merged.weight[m]);
+			} else {
+				out.push_back(values[c]);
+			}
+			c++;
+		}
+	}
+}
+
+/*
+Renders the output box row by row. For every row we compute where all of it's pixels sample from,
+fetch just the part of the input these positions fall into and copy the samples over. The input
+rows of the previous output row get released before the next one gets fetched.
+*/
+bool SyLensDeep::doDeepEngine(Box box, const ChannelSet& channels, DeepOutputPlane& plane)
+{
+	SY_TRACE_SPAN("SyLensDeep engine");
+	plane = DeepOutputPlane(channels, box);
+	if(!input0() || box.r() <= box.x()) return true;
+
+	const Box& input_box = input0()->deepInfo().box();
+	ChannelSet get_channels = channels;
+	get_channels += Mask_Deep;
+	const bool weighted = (k_sampling_ == WEIGHTED);
+
+	std::vector<Vector2> sources;
+	SyMergedSamples merged;
+	merged.num_channels = channels.size();
+	for(int y = box.y(); y < box.t(); y++) {
+		if(aborted()) return false;
+		sy_thread_counters.rows++;
+		sy_thread_counters.pixels += box.r() - box.x();
+
+		map_row_to_source(y, box.x(), box.r(), sources);
+
+		// The input pixels this row takes samples from. The source position is the lower left corner
+		// of the area to sample, so the nearest pixel is the one it rounds to.
+		int minX = input_box.r(), minY = input_box.t(), maxX = input_box.x(), maxY = input_box.y();
+		for(unsigned i = 0; i < sources.size(); i++) {
+			int sx = (int)floor(weighted ? sources[i].x : sources[i].x + 0.5f);
+			int sy = (int)floor(weighted ? sources[i].y : sources[i].y + 0.5f);
+			int reach = weighted ? 2 : 1;
+			minX = std::min(minX, sx);
+			minY = std::min(minY, sy);
+			maxX = std::max(maxX, sx + reach);
+			maxY = std::max(maxY, sy + reach);
+		}
+		Box row_source(minX, minY, maxX, maxY);
+		row_source.intersect(input_box);
+
+		DeepPlane in;
+		const bool have_input = row_source.r() > row_source.x() && row_source.t() > row_source.y();
+		if(have_input && !input0()->deepEngine(row_source, get_channels, in)) return false;
+
+		for(unsigned i = 0; i < sources.size(); i++) {
+			DeepOutPixel out;
+			if(!have_input) {
+				plane.addPixel(out);
+				continue;
+			}
+
+			const Vector2& source = sources[i];
+			if(weighted) {
+				int sx = (int)floor(source.x);
+				int sy = (int)floor(source.y);
+				float fx = source.x - sx;
+				float fy = source.y - sy;
+				const float weights[4] = { (1 - fx) * (1 - fy), fx * (1 - fy), (1 - fx) * fy, fx * fy };
+				merged.clear();
+				for(unsigned n = 0; n < 4; n++) {
+					int px = sx + (n & 1);
+					int py = sy + (n >> 1);
+					if(weights[n] <= 0.0f) continue;
+					if(px < row_source.x() || px >= row_source.r() || py < row_source.y() || py >= row_source.t()) continue;
+					merge_samples(in.getPixel(py, px), channels, weights[n], n, merged);
+				}
+				add_merged_samples(merged, channels, out);
+			} else {
+				int px = (int)floor(source.x + 0.5f);
+				int py = (int)floor(source.y + 0.5f);
+				if(px >= row_source.x() && px < row_source.r() && py >= row_source.y() && py < row_source.t()) {
+					add_samples(in.getPixel(py, px), channels, 1.0f, out);
+				}
+			}
+			plane.addPixel(out);
+		}
+	}
+	return true;
+}
+
+void SyLensDeep::knobs( Knob_Callback f) {
+	Knob* _output_selector = Enumeration_knob(f, &k_output, output_mode_names, "output");
+	_output_selector->label("output");
+	_output_selector->tooltip("Pick your poison");
+
+	distorter.knobs(f);
+	distorter.precision_knob(f);
+
+	Knob* kSamplingKnob = Enumeration_knob(f, &k_sampling_, sampling_names, "sampling");
+	kSamplingKnob->label("sampling");
+	kSamplingKnob->tooltip("nearest takes the samples of the input pixel closest to where the output pixel "
+		"comes from, unchanged. weighted takes the samples of the four pixels around it, scales them by "
+		"how close they are and merges the ones at the same depth. It is smoother, but gives more samples "
+		"where the pixels see different depths.");
+
+	SyPrewarm::knobs(f, &k_prewarm_);
+
+	Divider(f, 0);
+
+	std::ostringstream ver;
+	ver << "SyLensDeep v." << VERSION;
+	Text_knob(f, ver.str().c_str());
+}
+
+int SyLensDeep::knob_changed(Knob* k)
+{
+	if(SyPrewarm::is_prewarm_knob(k)) {
+		// Hands the LUT to the warm-up thread, with the aspect _validate() takes. See SyPrewarm.h
+		SyPrewarm::cancel(firstOp());
+		if(!input0() || !input0()->tryValidate(false)) return 1;
+		const Format& full = *input0()->deepInfo().formats().fullSizeFormat();
+
+		SyLutPrewarmJob* job = new SyLutPrewarmJob;
+		job->lens.copy_model_from(distorter);
+		job->aspect = float(full.width()) / float(full.height()) *  full.pixel_aspect();
+		SyPrewarm::schedule(firstOp(), job);
+		return 1;
+	}
+	if(k->is("showPanel") || distorter.is_lens_knob(k)) distorter.update_knobs(this);
+	if(distorter.is_lens_knob(k)) {
+		SyPrewarm::cancel(firstOp());
+		return 1;
+	}
+	return DeepFilterOp::knob_changed(k);
+}
@@ -0,0 +1,45 @@
+#include "SyParallel.h"
+
+// Everything a worker thread needs to know, passed as the userdata of Thread::spawn()
+struct SyParallelTask
+{
+	std::vector<SyChunk> chunks;
+	SyChunkFunction* fn;
+	void* userdata;
+};
+
+void SyParallel::run(const std::vector<unsigned>& job_sizes, SyChunkFunction* fn, void* userdata, unsigned chunk_size)
+{
+	SyParallelTask task;
+	task.fn = fn;
+	task.userdata = userdata;
+	
+	if(chunk_size == 0) chunk_size = 1;
+	for(unsigned job = 0; job < job_sizes.size(); job++) {
+		for(unsigned begin = 0; begin < job_sizes[job]; begin += chunk_size) {
+			task.chunks.push_back(SyChunk(job, begin, std::min(begin + chunk_size, job_sizes[job])));
+		}
+	}
+	
+	unsigned num_threads = std::min((unsigned)task.chunks.size(), (unsigned)Thread::numThreads);
+	
+	// Spawning threads for a single chunk is more expensive than just doing the work
+	if(num_threads < 2) {
+		work(0, 1, &task);
+		return;
+	}
+	
+	Thread::spawn(work, num_threads, &task);
+	Thread::wait(&task);
+}
+
+// The chunks are interleaved between the threads, so that big objects that come
+// one after another still get spread over all of them
+void SyParallel::work(unsigned thread_index, unsigned num_threads, void* t)
+{
+	SyParallelTask* task = (SyParallelTask*)t;
+	for(unsigned i = thread_index; i < task->chunks.size(); i += num_threads) {
+		const SyChunk& chunk = task->chunks[i];
+		task->fn(chunk.job, chunk.begin, chunk.end, task->userdata);
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef SY_PARALLEL_H
+#define SY_PARALLEL_H
+
+// For max/min on containers
+#include <algorithm>
+#include <vector>
+#include "DDImage/Thread.h"
+
+using namespace DD::Image;
+
+// Called by the worker threads for every chunk of work. job is the index of the job
+// as passed to SyParallel::run(), begin and end delimit the elements of that job
+// the function has to process (end is not included).
+typedef void SyChunkFunction(unsigned job, unsigned begin, unsigned end, void* userdata);
+
+// A piece of one job that is handed to a worker thread
+struct SyChunk
+{
+	unsigned job, begin, end;
+	SyChunk(unsigned j, unsigned b, unsigned e) : job(j), begin(b), end(e) {}
+};
+
+class SyParallel
+{
+public:
+	// Splits every job into chunks of at most chunk_size elements and runs the function on them
+	// using the Nuke worker threads. job_sizes contains the number of elements in each job (for example
+	// the number of points in every object). Returns when all the chunks have been processed.
+	// The function gets called concurrently so it should only write to the elements of its own chunk,
+	// which means that all the writable buffers have to be acquired before calling run()
+	static void run(const std::vector<unsigned>& job_sizes, SyChunkFunction* fn, void* userdata, unsigned chunk_size = 4096);
+
+private:
+	static void work(unsigned thread_index, unsigned num_threads, void* task);
+};
+
+#endif
@@ -0,0 +1,193 @@
+#include <cstdlib>
+#include <cstring>
+#include "SyPointStream.h"
+#include "SyParallel.h"
+
+// How many points get read, distorted and written at once
+static const unsigned POINT_BLOCK = 1 << 18;
+
+// How many points one thread distorts at a time
+static const unsigned POINT_CHUNK = 8192;
+
+SyPointStream::SyPointStream(SyDistorter& distorter, bool remove) : distorter_(distorter), remove_(remove)
+{
+	width_ = height_ = 0;
+}
+
+void SyPointStream::set_plate_size(unsigned width, unsigned height)
+{
+	width_ = width;
+	height_ = height;
+}
+
+long SyPointStream::process(FILE* in, FILE* out, SyPointFormat format)
+{
+	// Make sure the LUT is built before the threads start using it
+	distorter_.recompute_if_needed();
+
+	if(format == SY_POINTS_BINARY) return process_binary(in, out);
+	return process_csv(in, out);
+}
+
+void SyPointStream::distort_chunk(unsigned job, unsigned begin, unsigned end, void* userdata)
+{
+	SyPointStream* stream = (SyPointStream*)userdata;
+	Vector2* points = &stream->points_[begin];
+	unsigned count = end - begin;
+
+	if(stream->width_ == 0 || stream->height_ == 0) {
+		if(stream->remove_) {
+			stream->distorter_.remove_disto(points, count);
+		} else {
+			stream->distorter_.apply_disto(points, count);
+		}
+		return;
+	}
+
+	// Pixels to Syntheyes coordinates and back, the same as SyShader does
+	const float w = (float)stream->width_;
+	const float h = (float)stream->height_;
+	for(unsigned i = 0; i < count; i++) {
+		points[i].x = (points[i].x / w - 0.5f) * 2.0f;
+		points[i].y = (points[i].y / h - 0.5f) * 2.0f;
+	}
+	if(stream->remove_) {
+		stream->distorter_.remove_disto(points, count);
+	} else {
+		stream->distorter_.apply_disto(points, count);
+	}
+	for(unsigned i = 0; i < count; i++) {
+		points[i].x = (points[i].x / 2.0f + 0.5f) * w;
+		points[i].y = (points[i].y / 2.0f + 0.5f) * h;
+	}
+}
+
+void SyPointStream::distort_block()
+{
+	if(points_.empty()) return;
+	std::vector<unsigned> job_sizes(1, (unsigned)points_.size());
+	SyParallel::run(job_sizes, distort_chunk, this, POINT_CHUNK);
+}
+
+long SyPointStream::process_binary(FILE* in, FILE* out)
+{
+	long total = 0;
+	std::vector<float> buf;
+
+	while(true) {
+		buf.resize(POINT_BLOCK * 2);
+		size_t floats = fread(&buf[0], sizeof(float), buf.size(), in);
+		if(ferror(in)) return -1;
+
+		// A stray float at the very end has no pair, ignore it
+		unsigned count = (unsigned)(floats / 2);
+		points_.resize(count);
+		for(unsigned i = 0; i < count; i++) points_[i].set(buf[i * 2], buf[i * 2 + 1]);
+
+		distort_block();
+
+		for(unsigned i = 0; i < count; i++) {
+			buf[i * 2] = points_[i].x;
+			buf[i * 2 + 1] = points_[i].y;
+		}
+		if(count) fwrite(&buf[0], sizeof(float), count * 2, out);
+		if(ferror(out)) return -1;
+		total += count;
+
+		if(floats < buf.size()) break;
+	}
+
+	// A full disk or a closed pipe may only show up when the last of the buffer goes out
+	if(fflush(out) != 0) return -1;
+	return total;
+}
+
+// Reads one line without the line break. Returns false at the end of the file.
+static bool read_line(FILE* in, std::string& line)
+{
+	line.clear();
+	char buf[1024];
+	while(fgets(buf, sizeof(buf), in)) {
+		size_t len = strlen(buf);
+		if(len && buf[len - 1] == '\n') {
+			line.append(buf, len - 1);
+			if(!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+			return true;
+		}
+		line.append(buf, len);
+	}
+	return !line.empty();
+}
+
+// Parses "x,y" at the start of the line and sets tail to where the rest of the line starts
+static bool parse_point(const char* line, float& x, float& y, const char*& tail)
+{
+	char* end;
+	x = (float)strtod(line, &end);
+	if(end == line) return false;
+	while(*end == ' ' || *end == '\t') end++;
+	if(*end != ',') return false;
+
+	const char* second = end + 1;
+	y = (float)strtod(second, &end);
+	if(end == second) return false;
+
+	tail = end;
+	return true;
+}
+
+long SyPointStream::process_csv(FILE* in, FILE* out)
+{
+	long total = 0;
+
+	// Lines of the current block, and for every line the index of it's point or -1 when it gets passed through
+	std::vector<std::string> lines;
+	std::vector<long> tails;
+	std::vector<int> point_of_line;
+
+	bool more = true;
+	while(more) {
+		lines.clear();
+		tails.clear();
+		point_of_line.clear();
+		points_.clear();
+
+		std::string line;
+		while(points_.size() < POINT_BLOCK) {
+			if(!read_line(in, line)) {
+				more = false;
+				break;
+			}
+
+			float x, y;
+			const char* tail;
+			if(parse_point(line.c_str(), x, y, tail)) {
+				point_of_line.push_back((int)points_.size());
+				tails.push_back(tail - line.c_str());
+				points_.push_back(Vector2(x, y));
+			} else {
+				point_of_line.push_back(-1);
+				tails.push_back(0);
+			}
+			lines.push_back(line);
+		}
+		if(ferror(in)) return -1;
+
+		distort_block();
+
+		// 9 significant digits are enough to get the exact same float back when reading
+		for(unsigned i = 0; i < lines.size(); i++) {
+			int p = point_of_line[i];
+			if(p < 0) {
+				fprintf(out, "%s\n", lines[i].c_str());
+			} else {
+				fprintf(out, "%.9g,%.9g%s\n", points_[p].x, points_[p].y, lines[i].c_str() + tails[i]);
+			}
+		}
+		if(ferror(out)) return -1;
+		total += (long)points_.size();
+	}
+
+	if(fflush(out) != 0) return -1;
+	return total;
+}
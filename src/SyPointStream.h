@@ -0,0 +1,51 @@
+#ifndef SY_POINT_STREAM_H
+#define SY_POINT_STREAM_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "SyDistorter.h"
+
+// How the points are stored in the stream
+enum SyPointFormat {
+	// Text, one point per line as "x,y". Whatever follows y on the line (like ",frame,tracker")
+	// is passed through as is, and so are the lines that do not start with two numbers (like a header)
+	SY_POINTS_CSV,
+	// Pairs of 32 bit floats in the byte order of the machine, nothing else
+	SY_POINTS_BINARY
+};
+
+/*
+Applies or removes distortion for sets of 2D points too big to keep in memory, like the tracking data
+of a whole shot. The points get read in blocks, distorted by all the threads at once and written out.
+Every point goes through SyDistorter::apply_disto() or remove_disto() so the results are exactly
+the same as those of the plugins.
+*/
+class SyPointStream
+{
+public:
+	SyPointStream(SyDistorter& distorter, bool remove);
+
+	// By default the points are in the [-1..1, -1..1] Syntheyes coordinates. Call this when they are in pixels
+	// of a plate of width by height instead, with 0,0 being the lower left corner and width,height the upper right one.
+	void set_plate_size(unsigned width, unsigned height);
+
+	// Processes all the points from in and writes them to out, returns the number of points processed
+	// or -1 if the input could not be read or the output could not be written
+	long process(FILE* in, FILE* out, SyPointFormat format);
+
+private:
+	long process_csv(FILE* in, FILE* out);
+	long process_binary(FILE* in, FILE* out);
+	void distort_block();
+	static void distort_chunk(unsigned job, unsigned begin, unsigned end, void* userdata);
+
+	SyDistorter& distorter_;
+	bool remove_;
+	unsigned width_, height_;
+
+	// The block of points being processed
+	std::vector<Vector2> points_;
+};
+
+#endif
@@ -0,0 +1,195 @@
+#include "SyPrewarm.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// The name of the hidden knob sylens.py bumps
+static const char* const PREWARM_KNOB = "prewarm";
+
+// Guards everything below
+static Lock prewarm_lock;
+
+// Jobs waiting for the thread, and the ones that ran and hold on to what they built
+static std::deque<SyPrewarmJob*> prewarm_queue;
+static std::vector<SyPrewarmJob*> prewarm_finished;
+
+// The generation of the jobs of every node that has any. Cancelling removes the node, so jobs that
+// were scheduled before are not current anymore. Generations are never reused.
+static std::map<const void*, unsigned long> prewarm_generations;
+static unsigned long prewarm_last_generation = 0;
+
+// The thread is started when there is work and exits when the queue is empty
+static bool prewarm_thread_running = false;
+static bool prewarm_thread_spawned = false;
+static int prewarm_thread_token;
+
+SyPrewarmJob::SyPrewarmJob()
+{
+	owner_ = 0;
+	generation_ = 0;
+}
+
+SyPrewarmJob::~SyPrewarmJob()
+{
+}
+
+bool SyPrewarmJob::cancelled() const
+{
+	Guard guard(prewarm_lock);
+	return !SyPrewarm::current(this);
+}
+
+void SyLutPrewarmJob::run()
+{
+	lens.set_aspect(aspect);
+}
+
+// Call with prewarm_lock held
+bool SyPrewarm::current(const SyPrewarmJob* job)
+{
+	std::map<const void*, unsigned long>::iterator found = prewarm_generations.find(job->owner_);
+	return found != prewarm_generations.end() && found->second == job->generation_;
+}
+
+void SyPrewarm::schedule(const void* owner, SyPrewarmJob* job)
+{
+	Guard guard(prewarm_lock);
+
+	// All the jobs scheduled since the last cancel() belong together
+	std::map<const void*, unsigned long>::iterator found = prewarm_generations.find(owner);
+	if(found == prewarm_generations.end()) {
+		found = prewarm_generations.insert(std::make_pair(owner, ++prewarm_last_generation)).first;
+	}
+	job->owner_ = owner;
+	job->generation_ = found->second;
+	prewarm_queue.push_back(job);
+
+	if(prewarm_thread_running) return;
+
+	// The previous thread has left the queue already, so this does not block
+	if(prewarm_thread_spawned) Thread::wait(&prewarm_thread_token);
+	prewarm_thread_running = true;
+	prewarm_thread_spawned = true;
+	Thread::spawn(work, 1, &prewarm_thread_token);
+}
+
+void SyPrewarm::cancel(const void* owner)
+{
+	std::vector<SyPrewarmJob*> cancelled;
+	{
+		Guard guard(prewarm_lock);
+		if(prewarm_generations.erase(owner) == 0) return;
+
+		// The job that is running right now gets deleted by the thread when it is done
+		std::deque<SyPrewarmJob*> queue;
+		for(unsigned i = 0; i < prewarm_queue.size(); i++) {
+			if(prewarm_queue[i]->owner_ == owner) {
+				cancelled.push_back(prewarm_queue[i]);
+			} else {
+				queue.push_back(prewarm_queue[i]);
+			}
+		}
+		prewarm_queue.swap(queue);
+
+		std::vector<SyPrewarmJob*> finished;
+		for(unsigned i = 0; i < prewarm_finished.size(); i++) {
+			if(prewarm_finished[i]->owner_ == owner) {
+				cancelled.push_back(prewarm_finished[i]);
+			} else {
+				finished.push_back(prewarm_finished[i]);
+			}
+		}
+		prewarm_finished.swap(finished);
+	}
+
+	// Deleting releases the tables, which takes their locks, so we do it outside of ours
+	for(unsigned i = 0; i < cancelled.size(); i++) delete cancelled[i];
+}
+
+// Lowers the priority of the calling thread while it exists, the thread belongs to Nuke so it gets
+// it's priority back afterwards. Where we do not know how, the thread just keeps it's priority.
+class SyIdlePriority
+{
+public:
+	SyIdlePriority()
+	{
+#ifdef _WIN32
+		previous_ = GetThreadPriority(GetCurrentThread());
+		SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_IDLE);
+#elif defined(__linux__) && defined(SCHED_IDLE)
+		pthread_getschedparam(pthread_self(), &policy_, &param_);
+		struct sched_param idle;
+		idle.sched_priority = 0;
+		pthread_setschedparam(pthread_self(), SCHED_IDLE, &idle);
+#endif
+	}
+
+	~SyIdlePriority()
+	{
+#ifdef _WIN32
+		SetThreadPriority(GetCurrentThread(), previous_);
+#elif defined(__linux__) && defined(SCHED_IDLE)
+		pthread_setschedparam(pthread_self(), policy_, &param_);
+#endif
+	}
+
+private:
+#ifdef _WIN32
+	int previous_;
+#elif defined(__linux__) && defined(SCHED_IDLE)
+	int policy_;
+	struct sched_param param_;
+#endif
+};
+
+// Runs the queued jobs one after another until there are none left
+void SyPrewarm::work(unsigned thread_index, unsigned num_threads, void* userdata)
+{
+	SyIdlePriority idle;
+	while(true) {
+		SyPrewarmJob* job;
+		{
+			Guard guard(prewarm_lock);
+			if(prewarm_queue.empty()) {
+				prewarm_thread_running = false;
+				return;
+			}
+			job = prewarm_queue.front();
+			prewarm_queue.pop_front();
+		}
+
+		if(!job->cancelled()) {
+			SY_TRACE_SPAN("SyPrewarm job");
+			job->run();
+		}
+
+		// Keep what the job built until the node picks it up, unless the node changed in the meantime
+		bool keep;
+		{
+			Guard guard(prewarm_lock);
+			keep = current(job);
+			if(keep) prewarm_finished.push_back(job);
+		}
+		if(!keep) delete job;
+	}
+}
+
+void SyPrewarm::knobs(Knob_Callback f, int* request)
+{
+	Knob* kPrewarmKnob = Int_knob(f, request, PREWARM_KNOB);
+	kPrewarmKnob->set_flag(Knob::INVISIBLE);
+	kPrewarmKnob->set_flag(Knob::DO_NOT_WRITE);
+	kPrewarmKnob->set_flag(Knob::NO_UNDO);
+	kPrewarmKnob->set_flag(Knob::NO_ANIMATION);
+	kPrewarmKnob->set_flag(Knob::NO_RERENDER);
+	kPrewarmKnob->set_flag(Knob::KNOB_CHANGED_ALWAYS);
+}
+
+bool SyPrewarm::is_prewarm_knob(Knob* k)
+{
+	return k->is(PREWARM_KNOB);
+}
@@ -0,0 +1,73 @@
+#ifndef SY_PREWARM_H
+#define SY_PREWARM_H
+
+#include <deque>
+#include <map>
+#include <vector>
+#include "DDImage/Thread.h"
+#include "DDImage/Knobs.h"
+#include "SyDistorter.h"
+
+using namespace DD::Image;
+
+/*
+Builds the lens tables of the nodes on a background thread, so that the first render after opening
+a script does not have to. When SYLENS_PREWARM is set, sylens.py bumps the hidden "prewarm" knob of
+every SyLens family node once the script is loaded. The node then hands SyPrewarm a job with a copy of its
+lens, and the job builds the LUT (and whatever else the node would build in _validate()) into the shared
+caches. A job keeps what it built alive until the node validates and picks it up from the cache,
+or until the node changes - then the job gets cancelled and whatever it built is let go.
+
+There is only one warm-up thread and it runs at idle priority where the OS lets us, so it only uses
+the CPU nobody else wants. The tables get built and deleted outside the locks of the shared caches, which
+are only taken to look up and publish, so a render never waits on the idle thread while it works.
+*/
+class SyPrewarmJob
+{
+public:
+	SyPrewarmJob();
+	virtual ~SyPrewarmJob();
+
+	// Does the work. Jobs that take long should check cancelled() now and then and return early.
+	virtual void run() = 0;
+
+	// True once the node the job is for changed, validated or went away
+	bool cancelled() const;
+
+private:
+	friend class SyPrewarm;
+	const void* owner_;
+	unsigned long generation_;
+};
+
+// Builds the shared LUT of a lens. Fill the lens in with copy_model_from(), the aspect gets set
+// (and the LUT built) on the warm-up thread. The lens holds on to the LUT until the job is let go.
+class SyLutPrewarmJob : public SyPrewarmJob
+{
+public:
+	SyDistorter lens;
+	double aspect;
+	void run();
+};
+
+class SyPrewarm
+{
+public:
+	// Queues the job for the node owner (use the firstOp() of the node) and takes ownership of it
+	static void schedule(const void* owner, SyPrewarmJob* job);
+
+	// Cancels the jobs of owner and lets go of what they built. Call this when a lens knob changes,
+	// at the end of _validate() (the node has it's own references to the tables by then) and from the destructor.
+	static void cancel(const void* owner);
+
+	// Makes the hidden knob sylens.py bumps to ask the node for a warm-up
+	static void knobs(Knob_Callback f, int* request);
+	static bool is_prewarm_knob(Knob* k);
+
+private:
+	friend class SyPrewarmJob;
+	static void work(unsigned thread_index, unsigned num_threads, void* userdata);
+	static bool current(const SyPrewarmJob* job);
+};
+
+#endif
@@ -0,0 +1,269 @@
+#include <cmath>
+#include <algorithm>
+#include "SyReference.h"
+
+// The number of radii sampled into the table, the same as SyDistorter had
+static const unsigned REFERENCE_STEPS = 64;
+
+SyReferenceDistorter::SyReferenceDistorter(double k, double k_cube, double aspect, double shift_u, double shift_v)
+{
+	k_ = k;
+	k_cube_ = k_cube;
+	aspect_ = aspect;
+	shift_u_ = shift_u;
+	shift_v_ = shift_v;
+	anamorphic_ = false;
+	kx_ = ky_ = kxy_ = kyx_ = 0;
+
+	// The table goes up to the radius of the frame corner plus a cushion
+	double max_r = sqrt((aspect_ * aspect_) + 1);
+	double increment = max_r / float(REFERENCE_STEPS);
+	double r = 0;
+
+	Tuple center = { 0, 1, 0 };
+	lut_.push_back(center);
+	for(unsigned i = 0; i < REFERENCE_STEPS; i++) {
+		r += increment;
+		double f = distort_radial(r);
+		Tuple t = { r, f, r * f };
+		lut_.push_back(t);
+	}
+}
+
+void SyReferenceDistorter::set_anamorphic_terms(double kx, double ky, double kxy, double kyx)
+{
+	anamorphic_ = true;
+	kx_ = kx;
+	ky_ = ky;
+	kxy_ = kxy;
+	kyx_ = kyx;
+}
+
+double SyReferenceDistorter::distort_radial(double r) const
+{
+	double r2 = r * r;
+	if (fabs(k_cube_) > 0.00001) {
+		return 1 + r2*(k_ + k_cube_ * r);
+	} else {
+		return 1 + r2*(k_);
+	}
+}
+
+double SyReferenceDistorter::lerp(double x, double left_x, double right_x, double left_y, double right_y)
+{
+	double dx = right_x - left_x;
+	double dy = right_y - left_y;
+	double t = (x - left_x) / dx;
+	return left_y + (dy * t);
+}
+
+void SyReferenceDistorter::apply_disto(Vector2& pt) const
+{
+	pt.x -= shift_u_;
+	pt.y -= shift_v_;
+
+	if(anamorphic_) {
+		double x = pt.x, y = pt.y;
+		apply_anamorphic(x, y);
+		pt.x = x + shift_u_;
+		pt.y = y + shift_v_;
+		return;
+	}
+
+	// The radius and the factor are computed in float, like SyDistorter always did
+	float x = pt.x * aspect_;
+	float r = sqrt(x * x + (pt.y * pt.y));
+
+	const Tuple* left = 0;
+	const Tuple* right = 0;
+	for(unsigned i = 0; i < lut_.size() && !(left && right); i++) {
+		if(lut_[i].r < r) left = &lut_[i];
+		if(lut_[i].r > r) right = &lut_[i];
+	}
+
+	float f;
+	if(left && right) {
+		f = lerp(r, left->r, right->r, left->f, right->f);
+	} else {
+		f = distort_radial(r);
+	}
+
+	pt.x = pt.x * f;
+	pt.y = pt.y * f;
+
+	pt.x += shift_u_;
+	pt.y += shift_v_;
+}
+
+void SyReferenceDistorter::remove_disto(Vector2& pt) const
+{
+	pt.x += shift_u_;
+	pt.y += shift_v_;
+
+	if(anamorphic_) {
+		double x = pt.x, y = pt.y;
+		remove_anamorphic(x, y);
+		pt.x = x - shift_u_;
+		pt.y = y - shift_v_;
+		return;
+	}
+
+	double x = pt.x * aspect_;
+	double rd = sqrt((fabs(x) * fabs(x)) + (fabs(pt.y) * fabs(pt.y)));
+	double inv_f = undistort(rd);
+
+	pt.x = pt.x / inv_f;
+	pt.y = pt.y / inv_f;
+
+	pt.x -= shift_u_;
+	pt.y -= shift_v_;
+}
+
+double SyReferenceDistorter::undistort(double rd) const
+{
+	if(rd < lut_.back().r_distorted) {
+		return undistort_sampled(rd);
+	} else {
+		return undistort_approximated(rd);
+	}
+}
+
+double SyReferenceDistorter::undistort_sampled(double rd) const
+{
+	const Tuple* left = 0;
+	const Tuple* right = 0;
+	for(unsigned i = 0; i < lut_.size() && !(left && right); i++) {
+		if(lut_[i].r_distorted < rd) left = &lut_[i];
+		if(lut_[i].r_distorted > rd) right = &lut_[i];
+	}
+
+	if(!(left && right)) return undistort_approximated(rd);
+	return lerp(rd, left->r_distorted, right->r_distorted, left->f, right->f);
+}
+
+// Walks outwards from the end of the table until the distorted radius is passed. Past the wraparound
+// (where the factor goes negative) the factor at the end of the table is returned.
+double SyReferenceDistorter::undistort_approximated(double rp) const
+{
+	double r = lut_.back().r;
+	const double inc = 0.01f;
+	while(true) {
+		r += inc;
+		double f = distort_radial(r);
+		if(f < 0) return lut_.back().f;
+
+		double approx_rp = r * f;
+		if(approx_rp > rp) {
+			r -= inc;
+			double left_f = distort_radial(r);
+			double left_rp = r * left_f;
+			return lerp(rp, left_rp, approx_rp, left_f, f);
+		}
+	}
+}
+
+void SyReferenceDistorter::apply_anamorphic(double& x, double& y) const
+{
+	double ax = x * aspect_;
+	double r2 = ax * ax + y * y;
+	double f = distort_radial(sqrt(r2));
+	double new_x = x * (f + kx_ * ax * ax + kxy_ * y * y);
+	double new_y = y * (f + ky_ * y * y + kyx_ * ax * ax);
+	x = new_x;
+	y = new_y;
+}
+
+// The determinant of the Jacobian of apply_anamorphic(), taken numerically
+double SyReferenceDistorter::anamorphic_determinant(double x, double y, double& a, double& b, double& c, double& d) const
+{
+	const double h = 1e-7;
+	double fx = x, fy = y, xx = x + h, xy = y, yx = x, yy = y + h;
+	apply_anamorphic(fx, fy);
+	apply_anamorphic(xx, xy);
+	apply_anamorphic(yx, yy);
+	a = (xx - fx) / h;
+	c = (xy - fy) / h;
+	b = (yx - fx) / h;
+	d = (yy - fy) / h;
+	return a * d - b * c;
+}
+
+// Both factors positive and not folded over, see SyDistorter::anamorphic_unfolded()
+bool SyReferenceDistorter::anamorphic_unfolded(double x, double y) const
+{
+	double fx = x, fy = y;
+	apply_anamorphic(fx, fy);
+	if(x != 0 && fx / x <= 0) return false;
+	if(y != 0 && fy / y <= 0) return false;
+
+	double a, b, c, d;
+	return anamorphic_determinant(x, y, a, b, c, d) > 0.000001;
+}
+
+/*
+Plain Newton's method with the Jacobian taken numerically, so that it does not depend on the derivation
+SyDistorter uses. Halves the steps that do not get closer or leave the unfolded part of the image, and gives the
+first guess (the coordinate divided by the factors at it, magnified ten times at most) back for points past the
+wraparound, like SyDistorter.
+*/
+void SyReferenceDistorter::remove_anamorphic(double& x, double& y) const
+{
+	const double target_x = x, target_y = y;
+
+	double fx = x, fy = y;
+	apply_anamorphic(fx, fy);
+	bool positive = (x == 0 || fx / x > 0) && (y == 0 || fy / y > 0);
+	const double guess_x = (positive && x != 0) ? x / std::max(fx / x, 0.1) : x;
+	const double guess_y = (positive && y != 0) ? y / std::max(fy / y, 0.1) : y;
+	x = guess_x;
+	y = guess_y;
+
+	for(unsigned i = 0; i < 50; i++) {
+		double dx = x, dy = y;
+		apply_anamorphic(dx, dy);
+		double err_x = dx - target_x, err_y = dy - target_y;
+		double err = fabs(err_x) + fabs(err_y);
+		if(fabs(err_x) < 1e-10 && fabs(err_y) < 1e-10) return;
+
+		if(!anamorphic_unfolded(x, y)) break;
+		double a, b, c, d;
+		double det = anamorphic_determinant(x, y, a, b, c, d);
+
+		double step_x = (d * err_x - b * err_y) / det;
+		double step_y = (a * err_y - c * err_x) / det;
+
+		bool moved = false;
+		for(double t = 1; t > 0.01 && !moved; t *= 0.5) {
+			double nx = x - step_x * t, ny = y - step_y * t;
+			if(!anamorphic_unfolded(nx, ny)) continue;
+
+			double ndx = nx, ndy = ny;
+			apply_anamorphic(ndx, ndy);
+			if(fabs(ndx - target_x) + fabs(ndy - target_y) >= err) continue;
+
+			x = nx;
+			y = ny;
+			moved = true;
+		}
+		if(!moved) break;
+	}
+
+	x = guess_x;
+	y = guess_y;
+}
+
+void SyReferenceDistorter::distort_uv(const Vector4& source, Vector4& dest) const
+{
+	const double w = source.w;
+	double x = ((source.x / w) - 0.5f) * 2;
+	double y = ((source.y / w) - 0.5f) * 2;
+	double z = sqrt(x*x + y*y);
+
+	Vector2 syntheyes_uv(x, y);
+	apply_disto(syntheyes_uv);
+
+	syntheyes_uv.x = (syntheyes_uv.x / 2) + 0.5f;
+	syntheyes_uv.y = (syntheyes_uv.y / 2) + 0.5f;
+
+	dest.set(syntheyes_uv.x * w, syntheyes_uv.y * w, z, w);
+}
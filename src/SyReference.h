@@ -0,0 +1,53 @@
+#ifndef SY_REFERENCE_H
+#define SY_REFERENCE_H
+
+#include <vector>
+#include "DDImage/Vector2.h"
+#include "DDImage/Vector4.h"
+
+using namespace DD::Image;
+
+/*
+The plain scalar implementation of the Syntheyes distortion, the way SyDistorter computed it before
+any of the optimisations. sycheck compares everything SyDistorter does against this. It is frozen
+on purpose: do not speed it up and do not share code with SyDistorter, otherwise a bug could make it
+into both and go unnoticed.
+*/
+class SyReferenceDistorter
+{
+public:
+	SyReferenceDistorter(double k, double k_cube, double aspect, double shift_u, double shift_v);
+	
+	// Switches to the anamorphic model, which gets computed exactly instead of from a table
+	void set_anamorphic_terms(double kx, double ky, double kxy, double kyx);
+
+	// Same as the SyDistorter methods with the same names, in the [-1..1, -1..1] Syntheyes coordinates
+	void apply_disto(Vector2& pt) const;
+	void remove_disto(Vector2& pt) const;
+
+	// Same as SyDistorter::distort_uv(), for W-premultiplied UVs in the [0..1, 0..1] coordinates
+	void distort_uv(const Vector4& source, Vector4& dest) const;
+
+private:
+	struct Tuple
+	{
+		double r, f, r_distorted;
+	};
+
+	double distort_radial(double r) const;
+	double undistort(double rd) const;
+	double undistort_sampled(double rd) const;
+	double undistort_approximated(double rd) const;
+	static double lerp(double x, double left_x, double right_x, double left_y, double right_y);
+	void apply_anamorphic(double& x, double& y) const;
+	void remove_anamorphic(double& x, double& y) const;
+	bool anamorphic_unfolded(double x, double y) const;
+	double anamorphic_determinant(double x, double y, double& a, double& b, double& c, double& d) const;
+
+	double k_, k_cube_, aspect_, shift_u_, shift_v_;
+	bool anamorphic_;
+	double kx_, ky_, kxy_, kyx_;
+	std::vector<Tuple> lut_;
+};
+
+#endif
@@ -20,6 +20,7 @@ static const char* const HELP = "A UV-modifying shader to remove"
 #include <DDImage/gl.h>
 #include <sstream>
 #include "SyDistorter.cpp"
+#include "SyPrewarm.cpp"
 
 
 using namespace DD::Image;
@@ -34,14 +35,80 @@ static const char* const k_shader_types[] = {
 
 using namespace DD::Image;
 
+// How far outside of the 0..1 UV square the fragment shader table reaches, in Syntheyes
+// coordinates (where the UV square is -1..1)
+static const double UV_TABLE_EXTENT = 1.25;
+
+// The number of table cells across the 0..1 UV range for the texture of format f
+static int uv_table_resolution(int table_resolution, const Format& f)
+{
+	int resolution = table_resolution;
+	
+	// One table cell per 8 pixels of the texture is plenty for bilinear interpolation
+	if(resolution <= 0) resolution = std::max(f.width(), f.height()) / 8;
+	return std::max(16, std::min(resolution, 4096));
+}
+
+static U64 uv_table_key(SyDistorter& lens, int resolution)
+{
+	Hash table_hash;
+	table_hash.append(lens.compute_hash());
+	table_hash.append(resolution);
+	return table_hash.value();
+}
+
+static SyWarpGrid* bake_uv_table(SyDistorter& lens, int resolution)
+{
+	SY_TRACE_SPAN("SyShader table");
+	unsigned nodes = (unsigned)ceil(resolution * UV_TABLE_EXTENT) + 1;
+	SyWarpGrid* table = new SyWarpGrid;
+	table->resize(nodes, nodes, -UV_TABLE_EXTENT, -UV_TABLE_EXTENT, UV_TABLE_EXTENT, UV_TABLE_EXTENT);
+	lens.bake_apply_disto(*table);
+	return table;
+}
+
+// Warms up the LUT and, for the fragment shader, the UV table
+class SyShaderPrewarmJob : public SyLutPrewarmJob
+{
+public:
+	int resolution;
+	const SyWarpGrid* table;
+	
+	SyShaderPrewarmJob() { table = 0; }
+	~SyShaderPrewarmJob() { SyWarpGridCache::release(table); }
+	
+	void run()
+	{
+		SyLutPrewarmJob::run();
+		if(resolution <= 0 || cancelled()) return;
+		
+		U64 key = uv_table_key(lens, resolution);
+		table = SyWarpGridCache::acquire(key);
+		if(!table) table = SyWarpGridCache::publish(key, bake_uv_table(lens, resolution));
+	}
+};
+
 class SyShader : public Material
 {
 	int kShaderType;
+	
+	// Number of table cells across the 0..1 UV range, 0 picks it from the input format
+	int k_table_resolution;
 
 private:
 	// The distortion engine
 	SyDistorter distorter;
 	float _aspect;
+	
+	// Distorted UVs baked for the fragment shader, see update_uv_table(). Shared through
+	// SyWarpGridCache with the other nodes with the same lens and the warm-up.
+	const SyWarpGrid* uv_table;
+	
+	// The aspect, lens, shader type and table resolution the last _validate() set up
+	U64 validated_key_;
+	
+	// Bumped by sylens.py to ask for a warm-up, see SyPrewarm.h
+	int k_prewarm;
 
 public:
 
@@ -52,7 +119,17 @@ public:
 	SyShader(Node* node) : Material(node)
 	{
 		kShaderType = 0;
+		k_table_resolution = 0;
 		_aspect = 1.0f;
+		uv_table = 0;
+		k_prewarm = 0;
+		validated_key_ = 0;
+	}
+	
+	~SyShader()
+	{
+		SyPrewarm::cancel(this);
+		SyWarpGridCache::release(uv_table);
 	}
 	
 	/* virtual */
@@ -64,12 +141,80 @@ public:
 	}
 
 	void _validate(bool for_real) {
+		SY_TRACE_SPAN("SyShader validate");
 
-		Format f = input0().format();
-		_aspect = float(f.width()) / float(f.height()) *  f.pixel_aspect();
-		distorter.set_aspect(_aspect);
-		distorter.recompute_if_needed();
+		// The full size format gives the same aspect and the same table with proxy on and off
+		const Format& f = input0().full_size_format();
+		float aspect = float(f.width()) / float(f.height()) *  f.pixel_aspect();
+		int resolution = (kShaderType == 1) ? uv_table_resolution(k_table_resolution, f) : 0;
+		
+		// Nothing to redo when only something upstream of us changed
+		if(validated_key(aspect, resolution) != validated_key_) {
+			_aspect = aspect;
+			distorter.set_aspect(_aspect);
+			if(resolution > 0) {
+				update_uv_table(resolution);
+			} else {
+				// The vertex shader has no use for the table, let it go so the cache can drop it
+				SyWarpGridCache::release(uv_table);
+				uv_table = 0;
+			}
+			validated_key_ = validated_key(aspect, resolution);
+		}
 		Material::_validate(for_real);
+		SyPrewarm::cancel(firstOp());
+	}
+	
+	U64 validated_key(float aspect, int resolution)
+	{
+		Hash h;
+		h.append(aspect);
+		h.append(distorter.compute_hash());
+		h.append(kShaderType);
+		h.append(resolution);
+		return h.value();
+	}
+	
+	// The fragment shader does not compute the distortion for every sample but looks it up in
+	// a table instead. The table only gets rebaked when the distortion or the full resolution change.
+	void update_uv_table(int resolution)
+	{
+		U64 key = uv_table_key(distorter, resolution);
+		if(uv_table && uv_table->key() == key) return;
+		
+		SyWarpGridCache::release(uv_table);
+		uv_table = SyWarpGridCache::acquire(key);
+		if(!uv_table) uv_table = SyWarpGridCache::publish(key, bake_uv_table(distorter, resolution));
+	}
+	
+	int knob_changed(Knob* k)
+	{
+		if(SyPrewarm::is_prewarm_knob(k)) {
+			prewarm();
+			return 1;
+		}
+		if(k->is("showPanel") || distorter.is_lens_knob(k)) distorter.update_knobs(this);
+		if(distorter.is_lens_knob(k)) {
+			SyPrewarm::cancel(firstOp());
+			return 1;
+		}
+		return Material::knob_changed(k);
+	}
+	
+	// Hands what _validate() builds to the warm-up thread, see SyPrewarm.h
+	void prewarm()
+	{
+		SyPrewarm::cancel(firstOp());
+		if(!input0().tryValidate(false)) return;
+		
+		const Format& f = input0().full_size_format();
+		float aspect = float(f.width()) / float(f.height()) *  f.pixel_aspect();
+		
+		SyShaderPrewarmJob* job = new SyShaderPrewarmJob;
+		job->lens.copy_model_from(distorter);
+		job->aspect = aspect;
+		job->resolution = (kShaderType == 1) ? uv_table_resolution(k_table_resolution, f) : 0;
+		SyPrewarm::schedule(firstOp(), job);
 	}
 
 	/*virtual*/
@@ -84,25 +229,52 @@ public:
 		input0().vertex_shader(vtx);
 	}
 	
-	/* Request some more image - TODO */
+	// The texture gets sampled at the distorted UVs, so the part of the input we need is the
+	// requested area pushed through the distortion (which might be bigger or smaller than the
+	// requested one depending on the sign of k). Both shader types sample the same distorted UVs.
 	/*virtual*/
-//	void _request(int x, int y, int r, int t, ChannelMask channels, int count)
-//	{
-//		Vector2 corner(_aspect, 1);
-//		distorter.apply_disto(corner);
-//		float x_mult = 1 / corner.x;
-//		float y_mult = 1 / corner.y;
-//		Material::_request(ceil(x * x_mult), ceil(y * y_mult), ceil(r * x_mult), ceil(t * y_mult), channels, count);
-//	}
+	void _request(int x, int y, int r, int t, ChannelMask channels, int count)
+	{
+		SY_TRACE_SPAN("SyShader request");
+		Format f = input0().format();
+		const double w = f.width();
+		const double h = f.height();
+		
+		// Pixels to Syntheyes coordinates, like distort_uv() does with the UVs
+		double left = ((x / w) - 0.5) * 2;
+		double bottom = ((y / h) - 0.5) * 2;
+		double right = ((r / w) - 0.5) * 2;
+		double top = ((t / h) - 0.5) * 2;
+		
+		distorter.apply_disto_to_bounds(left, bottom, right, top);
+		
+		// Pad a few pixels for the filter of the texture sampler
+		const int padding = 4;
+		input0().request(
+			(int)floor(((left / 2) + 0.5) * w) - padding,
+			(int)floor(((bottom / 2) + 0.5) * h) - padding,
+			(int)ceil(((right / 2) + 0.5) * w) + padding,
+			(int)ceil(((top / 2) + 0.5) * h) + padding,
+			channels, count);
+	}
 
 	/*virtual*/
 	void fragment_shader(const VertexContext& vtx, Pixel& out) {
 
 		if (kShaderType == 1) {
-			VertexContext new_vtx(vtx);
-			Vector4& uv = new_vtx.vP.UV();
-			distorter.distort_uv(uv);
-			input0().fragment_shader(new_vtx,out);
+			// The input samples the texture at the distorted UV with a footprint taken from the UV
+			// derivatives, so both get distorted. On a copy of the context, since it belongs to the caller.
+			VertexContext distorted(vtx);
+			const Vector4& uv = vtx.vP.UV();
+			Vector4& distorted_uv = distorted.vP.UV();
+			if(uv_table) {
+				distorter.distort_uv(uv, distorted_uv, *uv_table);
+			} else {
+				distorter.distort_uv(uv, distorted_uv);
+			}
+			distorter.distort_uv_derivative(uv, distorted_uv, distorted.vdX.UV());
+			distorter.distort_uv_derivative(uv, distorted_uv, distorted.vdY.UV());
+			input0().fragment_shader(distorted, out);
 		} else {
 			input0().fragment_shader(vtx, out);
 		}
@@ -133,7 +305,16 @@ public:
 				"    regardless of how dense the geometry is.\n"
 				"    The result will NOT be redistorted by SyCamera.");
 		
+		Knob* _tableResolution = Int_knob(f, &k_table_resolution, "table_resolution");
+		_tableResolution->label("table resolution");
+		_tableResolution->tooltip(
+				"Only used by the fragment shader. The distortion is precomputed\n"
+				"into a table with this many cells across the texture and every\n"
+				"fragment looks its UV up in that table.\n"
+				"Leave at 0 to use one cell per 8 pixels of the input texture.");
+		
 		distorter.knobs(f);
+		SyPrewarm::knobs(f, &k_prewarm);
 		
 		Divider(f, 0);
 		std::ostringstream ver;
@@ -0,0 +1,198 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include "SyStats.h"
+
+// When this environment variable is set, the stats of every node get printed to stderr
+// when the node goes away or the process exits
+static const char* const STATS_DUMP_VARIABLE = "SYLENS_STATS";
+
+static void clear_counters(SyCounters& c)
+{
+	c.rows = c.pixels = 0;
+	c.lut_lookups = c.lut_fallbacks = c.lut_rebuilds = 0;
+	for(unsigned i = 0; i < SY_NUM_TIMERS; i++) c.time[i] = 0;
+	c.requests = 0;
+	c.requested_area = c.upstream_area = 0;
+}
+
+// Adds what changed from before to now to into
+static void add_difference(SyCounters& into, const SyCounters& now, const SyCounters& before)
+{
+	into.rows += now.rows - before.rows;
+	into.pixels += now.pixels - before.pixels;
+	into.lut_lookups += now.lut_lookups - before.lut_lookups;
+	into.lut_fallbacks += now.lut_fallbacks - before.lut_fallbacks;
+	into.lut_rebuilds += now.lut_rebuilds - before.lut_rebuilds;
+	into.requests += now.requests - before.requests;
+	into.requested_area += now.requested_area - before.requested_area;
+	into.upstream_area += now.upstream_area - before.upstream_area;
+}
+
+// Adds the counters of c to into
+static void add_counters(SyCounters& into, const SyCounters& c)
+{
+	SyCounters nothing;
+	clear_counters(nothing);
+	add_difference(into, c, nothing);
+}
+
+// The innermost SyStatsScope of the calling thread, 0 when there is none or it is paused
+static SY_THREAD_LOCAL SyStatsScope* sy_thread_scope = 0;
+
+// All the stats alive in the plugin, for the dump at exit
+static std::vector<SyStats*> all_stats;
+static Lock all_stats_lock;
+
+static bool dump_requested()
+{
+	return getenv(STATS_DUMP_VARIABLE) != 0;
+}
+
+static void dump_all_stats()
+{
+	all_stats_lock.lock();
+	for(unsigned i = 0; i < all_stats.size(); i++) {
+		fprintf(stderr, "%s", all_stats[i]->report().c_str());
+	}
+	all_stats.clear();
+	all_stats_lock.unlock();
+}
+
+SyStats::SyStats()
+{
+	clear_counters(totals_);
+	name_ = "SyLens";
+
+	if(!dump_requested()) return;
+
+	all_stats_lock.lock();
+	static bool dump_registered = false;
+	if(!dump_registered) {
+		atexit(dump_all_stats);
+		dump_registered = true;
+	}
+	all_stats.push_back(this);
+	all_stats_lock.unlock();
+}
+
+SyStats::~SyStats()
+{
+	if(!dump_requested()) return;
+
+	all_stats_lock.lock();
+	std::vector<SyStats*>::iterator found = std::find(all_stats.begin(), all_stats.end(), this);
+	bool registered = found != all_stats.end();
+	if(registered) all_stats.erase(found);
+	all_stats_lock.unlock();
+
+	if(registered) fprintf(stderr, "%s", report().c_str());
+}
+
+void SyStats::set_name(const std::string& name)
+{
+	lock_.lock();
+	name_ = name;
+	lock_.unlock();
+}
+
+void SyStats::add(const SyCounters& c)
+{
+	lock_.lock();
+	totals_.rows += c.rows;
+	totals_.pixels += c.pixels;
+	totals_.lut_lookups += c.lut_lookups;
+	totals_.lut_fallbacks += c.lut_fallbacks;
+	totals_.lut_rebuilds += c.lut_rebuilds;
+	for(unsigned i = 0; i < SY_NUM_TIMERS; i++) totals_.time[i] += c.time[i];
+	totals_.requests += c.requests;
+	totals_.requested_area += c.requested_area;
+	totals_.upstream_area += c.upstream_area;
+	lock_.unlock();
+}
+
+void SyStats::reset()
+{
+	lock_.lock();
+	clear_counters(totals_);
+	lock_.unlock();
+}
+
+std::string SyStats::report()
+{
+	lock_.lock();
+	SyCounters c = totals_;
+	std::string name = name_;
+	lock_.unlock();
+
+	U64 radii = c.lut_lookups + c.lut_fallbacks;
+
+	std::ostringstream out;
+	out << name << " stats\n";
+	out << "rows: " << c.rows << "\n";
+	out << "pixels: " << c.pixels << "\n";
+	out << "LUT lookups: " << c.lut_lookups << "\n";
+	out << "LUT fallbacks: " << c.lut_fallbacks;
+	if(radii) out << " (" << (100.0 * c.lut_fallbacks / radii) << "%)";
+	out << "\n";
+	out << "LUT rebuilds: " << c.lut_rebuilds << "\n";
+	out << "engine time: " << c.time[SY_TIME_ENGINE] << " s (thread time, summed over all threads)\n";
+	out << "validate time: " << c.time[SY_TIME_VALIDATE] << " s\n";
+	out << "request time: " << c.time[SY_TIME_REQUEST] << " s\n";
+	out << "requests: " << c.requests << "\n";
+	if(c.requested_area > 0) {
+		out << "upstream area per requested area: " << (c.upstream_area / c.requested_area) << "\n";
+	}
+	return out.str();
+}
+
+SyStatsScope::SyStatsScope(SyStats& stats, SyTimer timer) : stats_(stats), timer_(timer)
+{
+	before_ = sy_thread_counters;
+	start_ = sy_clock();
+	clear_counters(excluded_);
+	excluded_time_ = 0;
+	parent_ = sy_thread_scope;
+	sy_thread_scope = this;
+}
+
+SyStatsScope::~SyStatsScope()
+{
+	const SyCounters& now = sy_thread_counters;
+	const double elapsed = sy_clock() - start_;
+
+	// Everything since we started, minus what belongs to the nested scopes and the pauses
+	SyCounters counted_from = before_;
+	add_counters(counted_from, excluded_);
+	SyCounters delta;
+	clear_counters(delta);
+	add_difference(delta, now, counted_from);
+	delta.time[timer_] = elapsed - excluded_time_;
+	stats_.add(delta);
+
+	// And all of it does not belong to the scope we are nested in
+	sy_thread_scope = parent_;
+	if(parent_) {
+		add_difference(parent_->excluded_, now, before_);
+		parent_->excluded_time_ += elapsed;
+	}
+}
+
+SyStatsPause::SyStatsPause()
+{
+	scope_ = sy_thread_scope;
+	before_ = sy_thread_counters;
+	start_ = sy_clock();
+
+	// The scopes made while we are paused are not nested in ours
+	sy_thread_scope = 0;
+}
+
+SyStatsPause::~SyStatsPause()
+{
+	sy_thread_scope = scope_;
+	if(!scope_) return;
+	add_difference(scope_->excluded_, sy_thread_counters, before_);
+	scope_->excluded_time_ += sy_clock() - start_;
+}
@@ -0,0 +1,109 @@
+#ifndef SY_STATS_H
+#define SY_STATS_H
+
+#include <string>
+#include <vector>
+#include "DDImage/Thread.h"
+#include "DDImage/Hash.h"
+#include "SyClock.h"
+
+using namespace DD::Image;
+
+// Every render thread counts in it's own copy of the counters, so counting needs no locking at all
+#ifdef _WIN32
+#define SY_THREAD_LOCAL __declspec(thread)
+#else
+#define SY_THREAD_LOCAL __thread
+#endif
+
+// The phases of a node we measure the time of
+enum SyTimer { SY_TIME_ENGINE, SY_TIME_VALIDATE, SY_TIME_REQUEST, SY_NUM_TIMERS };
+
+// What happened on the hot paths. This has to stay plain data so that it can be thread local.
+struct SyCounters
+{
+	// Rows and pixels rendered
+	U64 rows, pixels;
+
+	// Sampled pixels whose source position came from the LUT, the ones beyond the LUT that had to be computed
+	// without it, LUT rebuilds
+	U64 lut_lookups, lut_fallbacks, lut_rebuilds;
+
+	// Seconds spent in every SyTimer
+	double time[SY_NUM_TIMERS];
+
+	// Area requested from downstream and the area we requested from upstream for it, in pixels
+	U64 requests;
+	double requested_area, upstream_area;
+};
+
+// The counters of the calling thread. The nodes add to these once per row or stripe, and never per pixel.
+static SY_THREAD_LOCAL SyCounters sy_thread_counters;
+
+// Counters and timings of one node, summed up over all the threads that worked for it
+class SyStats
+{
+public:
+	SyStats();
+	~SyStats();
+
+	// The name shown in the dump, usually the name of the node
+	void set_name(const std::string& name);
+
+	// Adds the counters of one thread
+	void add(const SyCounters& counters);
+
+	void reset();
+
+	// Returns the totals as text, one counter per line
+	std::string report();
+
+private:
+	Lock lock_;
+	SyCounters totals_;
+	std::string name_;
+};
+
+/*
+Takes the counters of the calling thread when created and adds what changed since to the stats when it
+goes out of scope, together with the time it took. This way the stats get locked once per stripe or validate
+instead of once for every counted thing.
+
+The nodes upstream do their work on the same thread, nested in ours - a SyLens feeding another one renders
+it's rows from within the sample() calls of the downstream one. A scope that gets created within another one
+counts for it's own node only and gets left out of the outer one, and so does everything within a SyStatsPause.
+*/
+class SyStatsScope
+{
+public:
+	SyStatsScope(SyStats& stats, SyTimer timer);
+	~SyStatsScope();
+
+private:
+	friend class SyStatsPause;
+	SyStats& stats_;
+	SyTimer timer_;
+	SyCounters before_;
+	double start_;
+
+	// The scope this one is nested in, and what happened within this one that belongs to someone else
+	SyStatsScope* parent_;
+	SyCounters excluded_;
+	double excluded_time_;
+};
+
+// Leaves whatever happens while it exists out of the innermost scope of the calling thread. Put it around
+// the calls into the inputs, so that the work of the nodes upstream does not count as the work of this one.
+class SyStatsPause
+{
+public:
+	SyStatsPause();
+	~SyStatsPause();
+
+private:
+	SyStatsScope* scope_;
+	SyCounters before_;
+	double start_;
+};
+
+#endif
@@ -0,0 +1,127 @@
+#include "SyTrace.h"
+
+#ifdef SY_TRACE
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+// The name of the environment variable with the path of the trace file to write at exit
+static const char* const TRACE_FILE_VARIABLE = "SY_TRACE_FILE";
+
+// Every plugin has it's own copy of the tracer. They all write into the same file at exit one after another,
+// and count how many did so far in this variable. The first one starts the file anew.
+static const char* const TRACE_WRITERS_VARIABLE = "SY_TRACE_WRITERS";
+
+static SyTraceEvent trace_events[SY_TRACE_CAPACITY];
+
+// How many events have been recorded in total. The event goes into the slot at this index modulo the capacity,
+// so once the buffer is full the oldest events get overwritten.
+static volatile unsigned long trace_count = 0;
+
+// Threads get small consecutive numbers in the order they record their first event
+static volatile unsigned long trace_thread_count = 0;
+static SY_THREAD_LOCAL unsigned trace_thread_id = 0;
+
+static volatile long trace_exit_registered = 0;
+
+#ifdef _WIN32
+#define SY_ATOMIC_INCREMENT(counter) ((unsigned long)InterlockedIncrement((volatile LONG*)&(counter)) - 1)
+#define SY_ATOMIC_SET(flag) InterlockedExchange((volatile LONG*)&(flag), 1)
+#else
+#define SY_ATOMIC_INCREMENT(counter) __sync_fetch_and_add(&(counter), 1)
+#define SY_ATOMIC_SET(flag) __sync_lock_test_and_set(&(flag), 1)
+#endif
+
+// The file name of the plugin this copy of the tracer is in, to tell the plugins apart in the trace
+static std::string trace_plugin_name()
+{
+	std::string path;
+#ifdef _WIN32
+	HMODULE module = 0;
+	char buffer[MAX_PATH];
+	if(GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT,
+		(LPCSTR)&trace_events, &module) && GetModuleFileNameA(module, buffer, MAX_PATH)) {
+		path = buffer;
+	}
+#else
+	Dl_info info;
+	if(dladdr((void*)&trace_events, &info) && info.dli_fname) path = info.dli_fname;
+#endif
+	size_t slash = path.find_last_of("/\\");
+	if(slash != std::string::npos) path = path.substr(slash + 1);
+	return path.empty() ? "SyLens plugin" : path;
+}
+
+static void write_trace_at_exit()
+{
+	const char* path = getenv(TRACE_FILE_VARIABLE);
+	if(path && *path) SyTracer::write_json(path);
+}
+
+void SyTracer::record(const char* name, double start, double end)
+{
+	if(trace_thread_id == 0) {
+		trace_thread_id = SY_ATOMIC_INCREMENT(trace_thread_count) + 1;
+		if(SY_ATOMIC_SET(trace_exit_registered) == 0) atexit(write_trace_at_exit);
+	}
+
+	unsigned long index = SY_ATOMIC_INCREMENT(trace_count);
+	SyTraceEvent& event = trace_events[index & (SY_TRACE_CAPACITY - 1)];
+	event.name = name;
+	event.start = start;
+	event.end = end;
+	event.thread = trace_thread_id;
+}
+
+/*
+The file is in the JSON array format of the Chrome trace, which may be left without the closing bracket.
+That lets every plugin append it's events under a pid of it's own, and name the pid after the plugin.
+The timestamps are the clock itself and not relative to the first event, so that the plugins line up.
+*/
+bool SyTracer::write_json(const char* path)
+{
+	const char* writers_value = getenv(TRACE_WRITERS_VARIABLE);
+	int writers = writers_value ? atoi(writers_value) : 0;
+
+	FILE* out = fopen(path, writers ? "a" : "w");
+	if(!out) return false;
+
+	const int pid = writers + 1;
+	char pid_value[16];
+	sprintf(pid_value, "%d", pid);
+#ifdef _WIN32
+	_putenv_s(TRACE_WRITERS_VARIABLE, pid_value);
+#else
+	setenv(TRACE_WRITERS_VARIABLE, pid_value, 1);
+#endif
+
+	if(!writers) fprintf(out, "[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+		pid, trace_plugin_name().c_str());
+
+	unsigned long count = trace_count;
+	unsigned long first = count > SY_TRACE_CAPACITY ? count - SY_TRACE_CAPACITY : 0;
+
+	// Chrome wants microseconds
+	for(unsigned long i = first; i < count; i++) {
+		const SyTraceEvent& event = trace_events[i & (SY_TRACE_CAPACITY - 1)];
+		fprintf(out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f},\n",
+			event.name,
+			pid,
+			event.thread,
+			event.start * 1000000.0,
+			(event.end - event.start) * 1000000.0
+		);
+	}
+	fclose(out);
+	return true;
+}
+
+#endif
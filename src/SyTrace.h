@@ -0,0 +1,67 @@
+#ifndef SY_TRACE_H
+#define SY_TRACE_H
+
+/*
+Tracing of what the plugins spend their time on, for looking at renders in chrome://tracing (or Perfetto).
+It only gets compiled in when SY_TRACE is defined, otherwise SY_TRACE_SPAN() expands to nothing and costs nothing.
+
+Put SY_TRACE_SPAN("name") at the start of a block and the time until the end of the block gets recorded,
+together with the thread it ran on. The name has to be a string literal (or otherwise live forever).
+Recording takes one atomic increment and no locks - the events go into a ring buffer that keeps the last
+SY_TRACE_CAPACITY of them. When the process exits the buffer is written as Chrome trace JSON to the file named
+in the SY_TRACE_FILE environment variable (nothing is written when it is not set).
+
+Every plugin binary has it's own buffer, so they all write into the same file: the first one to exit starts it,
+the others append. Each plugin shows up as a process of it's own, named after the plugin file. The count of
+plugins that have written so far is kept in the SY_TRACE_WRITERS environment variable. The array is left open
+at the end, which the trace viewers accept.
+*/
+
+#ifdef SY_TRACE
+
+#include "SyClock.h"
+#include "SyStats.h"
+
+// Has to be a power of two
+#define SY_TRACE_CAPACITY (1 << 16)
+
+struct SyTraceEvent
+{
+	const char* name;
+	double start, end;
+	unsigned thread;
+};
+
+class SyTracer
+{
+public:
+	// Stores one finished span. Safe to call from any thread.
+	static void record(const char* name, double start, double end);
+
+	// Writes the recorded spans as Chrome trace JSON into the file at path
+	static bool write_json(const char* path);
+};
+
+// Records the time from it's creation until it goes out of scope
+class SyTraceSpan
+{
+public:
+	SyTraceSpan(const char* name) : name_(name), start_(sy_clock()) {}
+	~SyTraceSpan() { SyTracer::record(name_, start_, sy_clock()); }
+
+private:
+	const char* name_;
+	double start_;
+};
+
+#define SY_TRACE_CONCAT_(a, b) a##b
+#define SY_TRACE_CONCAT(a, b) SY_TRACE_CONCAT_(a, b)
+#define SY_TRACE_SPAN(name) SyTraceSpan SY_TRACE_CONCAT(sy_trace_span_, __LINE__)(name)
+
+#else
+
+#define SY_TRACE_SPAN(name)
+
+#endif
+
+#endif
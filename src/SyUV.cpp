@@ -17,10 +17,35 @@ static const char* const HELP = "This node will apply the Syntheyes undistortion
 #include "DDImage/Knob.h"
 #include "DDImage/Knobs.h"
 #include <sstream>
+#include <vector>
 #include "SyDistorter.cpp"
+#include "SyParallel.cpp"
+#include "SyPrewarm.cpp"
 
 using namespace DD::Image;
 
+// Distorted UVs of one object, kept around so that we do not have to redistort
+// when only the points or the transforms of the input geometry changed
+struct SyUVCacheEntry
+{
+	U64 key;
+	std::vector<Vector4> uvs;
+	
+	SyUVCacheEntry() : key(0) {}
+};
+
+// The UVs of one object that are going to be distorted by the worker threads
+struct SyUVJob
+{
+	// Holds on to the original attribute while the workers read from it
+	AttributePtr original;
+	const Vector4* source;
+	Vector4* dest;
+	unsigned count;
+	SyUVCacheEntry* cached;
+	bool cache_hit;
+};
+
 class SyUV : public ModifyGeo
 {
 private:
@@ -30,8 +55,14 @@ private:
 	// The distortion engine
 	SyDistorter distorter;
 	
-	// Group type ptr detected in keep_uvs()
-	DD::Image::GroupType t_group_type;
+	// Distorted UVs per object index, see distort_uvs_of()
+	std::vector<SyUVCacheEntry> uv_cache;
+	
+	// The objects being processed in modify_geometry()
+	std::vector<SyUVJob> uv_jobs;
+	
+	// Bumped by sylens.py to ask for a warm-up, see SyPrewarm.h
+	int k_prewarm;
 	
 public:
 
@@ -50,6 +81,12 @@ public:
 	SyUV(Node* node) : ModifyGeo(node)
 	{
 		uv_attrib_name = "uv";
+		k_prewarm = 0;
+	}
+	
+	~SyUV()
+	{
+		SyPrewarm::cancel(this);
 	}
 	
 	void append(Hash& hash) {
@@ -66,6 +103,7 @@ public:
 		ModifyGeo::knobs(f);
 		
 		distorter.knobs_with_aspect(f);
+		SyPrewarm::knobs(f, &k_prewarm);
 		
 		Knob* uv_attr_name_knob = String_knob(f, &uv_attrib_name, "uv_attrib_name");
 		uv_attr_name_knob->label("uv attrib name");
@@ -82,85 +120,149 @@ public:
 		// Get all hashes up-to-date
 		ModifyGeo::get_geometry_hash();
 		
-		// Knobs that change the SyLens algo:
-		geo_hash[Group_Points].append(distorter.compute_hash());
-		geo_hash[Group_Points].append(uv_attrib_name);
+		// Knobs that change the SyLens algo. The UVs are attributes so we only
+		// invalidate the attribute group, points and primitives stay untouched.
+		geo_hash[Group_Attributes].append(distorter.compute_hash());
+		geo_hash[Group_Attributes].append(uv_attrib_name);
 	}
 	
 	void _validate(bool for_real)
 	{
+		SY_TRACE_SPAN("SyUV validate");
 		distorter.recompute_if_needed();
+		SyPrewarm::cancel(firstOp());
 		return ModifyGeo::_validate(for_real);
 	}
 	
-	// This is needed to preserve UVs which are already there
-	void keep_uvs(int index, GeoInfo& info, GeometryList& out)
+	int knob_changed(Knob* k)
 	{
-		
-		// get the original uv attribute used to restore untouched uv coordinate
+		if(SyPrewarm::is_prewarm_knob(k)) {
+			// The aspect is a knob, so the lens is all the job needs
+			SyPrewarm::cancel(firstOp());
+			SyLutPrewarmJob* job = new SyLutPrewarmJob;
+			job->lens.copy_model_from(distorter);
+			job->aspect = distorter.aspect();
+			SyPrewarm::schedule(firstOp(), job);
+			return 1;
+		}
+		if(k->is("showPanel") || distorter.is_lens_knob(k)) distorter.update_knobs(this);
+		if(distorter.is_lens_knob(k)) {
+			SyPrewarm::cancel(firstOp());
+			return 1;
+		}
+		return ModifyGeo::knob_changed(k);
+	}
+	
+	// The key under which the distorted UVs of the object get cached. It changes when the
+	// upstream attributes or the distortion change, but not when only the points, primitives
+	// or matrices of the input do (like with an animated camera or a deforming mesh)
+	U64 uv_cache_key(int index, DD::Image::GroupType group_type, unsigned num_of_elements, U64 disto_hash)
+	{
+		Hash h;
+		h.append(input0()->hash(Group_Attributes).value());
+		h.append(disto_hash);
+		h.append(uv_attrib_name);
+		h.append(index);
+		h.append((int)group_type);
+		h.append(num_of_elements);
+		return h.value();
+	}
+	
+	// Reads the original UVs of the object once and writes the distorted values straight
+	// into the writable attribute. The UVs are only touched in the group they are stored in
+	// (points or vertices), so there is no separate copy pass. If the UVs of this object
+	// have been distorted before with the same settings the cached result is used instead.
+	// All the GeometryList access happens here, the actual work is done later by the
+	// worker threads in process_uv_chunk()
+	bool prepare_uvs_of(int index, GeoInfo& info, GeometryList& out, U64 disto_hash, SyUVJob& job)
+	{
+		// get the original uv attribute that we read the undistorted coordinates from
 		const AttribContext* context = info.get_attribcontext(uv_attrib_name);
 		AttributePtr uv_original = context ? context->attribute : AttributePtr();
 		
 		if(!uv_original){
 			Op::error( "Missing \"%s\" channel from geometry", uv_attrib_name );
-			return;
+			return false;
 		}
-
-		t_group_type = context->group; // texture coordinate group type
-
+		
 		// we have two possibilities:
-		// the uv coordinate are stored in Group_Points or in Group_Vertices way
+		// the uv coordinate are stored in Group_Points or in Group_Vertices way.
+		// Vertex attribs take precedence and say a Sphere in Nuke has vertex attribs
+		// as opposed to point attribs, so we follow whatever the context says
+		DD::Image::GroupType group_type = context->group;
+		
 		// sanity check
-		assert(t_group_type == Group_Points || t_group_type == Group_Vertices);
+		assert(group_type == Group_Points || group_type == Group_Vertices);
 		
 		// create a buffer to write on it
-		Attribute* uv = out.writable_attribute(index, t_group_type, uv_attrib_name, VECTOR4_ATTRIB);
-		assert(uv);
-
-		// copy all original texture coordinate if available
-		if (uv_original){
-			// sanity check
-			assert(uv->size() == uv_original->size());
-
-			for (unsigned i = 0; i < uv->size(); i++) {
-				uv->vector4(i) = uv_original->vector4(i);
-			}
+		Attribute* uv = out.writable_attribute(index, group_type, uv_attrib_name, VECTOR4_ATTRIB);
+		if(!uv) return false;
+		
+		// sanity check
+		assert(uv->size() == uv_original->size());
+		
+		const unsigned num_of_elements = std::min(uv->size(), uv_original->size());
+		if(num_of_elements == 0) return false;
+		
+		SyUVCacheEntry& cached = uv_cache[index];
+		U64 key = uv_cache_key(index, group_type, num_of_elements, disto_hash);
+		
+		job.original = uv_original;
+		job.source = &uv_original->vector4(0);
+		job.dest = &uv->vector4(0);
+		job.count = num_of_elements;
+		job.cached = &cached;
+		job.cache_hit = (cached.key == key && cached.uvs.size() == num_of_elements);
+		
+		if(!job.cache_hit) {
+			// Make room for the results up front so that the workers only write into their own range
+			cached.uvs.resize(num_of_elements);
+			cached.key = key;
 		}
+		return true;
 	}
 	
-	// Apply distortion to each element in the passed vertex or point attribute
-	void distort_each_element_in_attribute(Attribute* attr, unsigned const int num_of_elements)
+	// Runs on the worker threads for a range of UVs of one object
+	static void process_uv_chunk(unsigned job_idx, unsigned begin, unsigned end, void* userdata)
 	{
-		if(!attr) return;
-		for (unsigned point_idx = 0; point_idx < num_of_elements; point_idx++) {
-			distorter.distort_uv(attr->vector4(point_idx));
+		SY_TRACE_SPAN("SyUV chunk");
+		SyUV* self = (SyUV*)userdata;
+		const SyUVJob& job = self->uv_jobs[job_idx];
+		Vector4* dest = job.dest + begin;
+		Vector4* cached = &job.cached->uvs[0] + begin;
+		
+		if(job.cache_hit) {
+			std::copy(cached, cached + (end - begin), dest);
+		} else {
+			self->distorter.distort_uvs(job.source + begin, dest, end - begin);
+			std::copy(dest, dest + (end - begin), cached);
 		}
 	}
 	
 	void modify_geometry(int obj, Scene& scene, GeometryList& out)
 	{
-		// Call the engine on all the caches:
+		SY_TRACE_SPAN("SyUV geometry");
+		
+		// Objects that went away upstream take their cached UVs with them
+		uv_cache.resize(out.objects());
+		
+		U64 disto_hash = distorter.compute_hash();
+		
+		// Grab all the writable attributes first, so that the workers never have to touch the GeometryList
+		uv_jobs.clear();
+		std::vector<unsigned> job_sizes;
 		for (unsigned i = 0; i < out.objects(); i++) {
 			GeoInfo& info = out[i];
-			
-			// Copy over old UV attributes
-			keep_uvs(i, info, out);
-			
-			// Reusable pointer for the attribute we are going to be writing to
-			Attribute* uv;
-			
-			// Copy over pt attributes
-			uv = out.writable_attribute(i, Group_Points, uv_attrib_name, VECTOR4_ATTRIB);
-			distort_each_element_in_attribute(uv, info.points());
-			
-			// If the previously detected group type is vertex attribute we need to distort it as well
-			// since vertex attribs take precedence and say a Sphere in Nuke has vertex attribs
-			// as opposed to point attribs :-( so justified double work here
-			if(t_group_type == Group_Vertices) {
-				uv = out.writable_attribute(i, Group_Vertices, uv_attrib_name, VECTOR4_ATTRIB);
-				distort_each_element_in_attribute(uv, info.vertices()); // Copy over vertex attributes
+			SyUVJob job;
+			if(prepare_uvs_of(i, info, out, disto_hash, job)) {
+				uv_jobs.push_back(job);
+				job_sizes.push_back(job.count);
 			}
 		}
+		
+		// and distort (or restore from the cache) all of them at once, spread over all the threads
+		SyParallel::run(job_sizes, process_uv_chunk, this);
+		uv_jobs.clear();
 	}
 };
 
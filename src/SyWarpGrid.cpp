@@ -0,0 +1,380 @@
+#include "SyWarpGrid.h"
+#include "DDImage/Thread.h"
+
+// The spacing of the coarse grid of the compact storage, in nodes
+static const unsigned COMPACT_STEP = 8;
+
+SyWarpGrid::SyWarpGrid()
+{
+	nx_ = ny_ = 0;
+	left_ = bottom_ = 0;
+	step_x_ = step_y_ = inv_step_x_ = inv_step_y_ = 1;
+	key_ = 0;
+	coarse_nx_ = 0;
+}
+
+// Rounds the float to the nearest half float. Values too small for a half become 0, the grid
+// never has values too large for one.
+static unsigned short float_to_half(float value)
+{
+	union { float f; unsigned int u; } bits;
+	bits.f = value;
+	
+	unsigned int sign = (bits.u >> 16) & 0x8000;
+	int exponent = (int)((bits.u >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = bits.u & 0x7fffff;
+	
+	if(exponent >= 31) return sign | 0x7c00;
+	
+	// Denormal half
+	if(exponent <= 0) {
+		if(exponent < -10) return sign;
+		mantissa |= 0x800000;
+		unsigned int shift = 14 - exponent;
+		unsigned int half = mantissa >> shift;
+		if((mantissa >> (shift - 1)) & 1) half++;
+		return sign | half;
+	}
+	
+	// A carry from rounding the mantissa moves into the exponent, which is what we want
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	if(mantissa & 0x1000) half++;
+	return half;
+}
+
+/*
+Converts count half floats to floats. There are no branches and no tables in here. The exponent gets
+rebiased by adding to the bits, and denormal halves are made normal by adding one to the exponent
+and subtracting the implied one afterwards.
+*/
+static void decode_halfs(const unsigned short* halfs, float* out, unsigned count)
+{
+	for(unsigned n = 0; n < count; n++) {
+		unsigned int h = halfs[n];
+		unsigned int magnitude = ((h & 0x7fff) << 13) + ((127 - 15) << 23);
+		
+		union { float f; unsigned int u; } normal, denormal, result;
+		normal.u = magnitude;
+		denormal.u = magnitude + (1 << 23);
+		denormal.f -= 6.103515625e-05f; // 2^-14
+		
+		result.f = (h & 0x7c00) ? normal.f : denormal.f;
+		result.u |= (h & 0x8000) << 16;
+		out[n] = result.f;
+	}
+}
+
+void SyWarpGrid::resize(unsigned nx, unsigned ny, double left, double bottom, double right, double top)
+{
+	nx_ = std::max(nx, 2u);
+	ny_ = std::max(ny, 2u);
+	left_ = left;
+	bottom_ = bottom;
+	step_x_ = (right - left) / (nx_ - 1);
+	step_y_ = (top - bottom) / (ny_ - 1);
+	inv_step_x_ = 1.0 / step_x_;
+	inv_step_y_ = 1.0 / step_y_;
+	nodes_.assign(nx_ * ny_ * 2, 0.0f);
+	key_ = 0;
+	
+	// Start out with full floats again
+	std::vector<float>().swap(coarse_);
+	std::vector<unsigned short>().swap(residuals_);
+}
+
+void SyWarpGrid::clear()
+{
+	std::vector<float>().swap(nodes_);
+	std::vector<float>().swap(coarse_);
+	std::vector<unsigned short>().swap(residuals_);
+	nx_ = ny_ = 0;
+	key_ = 0;
+}
+
+size_t SyWarpGrid::memory_size() const
+{
+	return nodes_.size() * sizeof(float) + coarse_.size() * sizeof(float) 
+		+ residuals_.size() * sizeof(unsigned short);
+}
+
+// For every one of the n nodes along an axis, finds the cell of the coarse grid it is in and
+// the position within that cell. The coarse nodes are at every COMPACT_STEP-th node and at the last one.
+static unsigned coarse_cells(unsigned n, std::vector<unsigned>& cells, std::vector<float>& t)
+{
+	unsigned coarse_n = (n - 1 + COMPACT_STEP - 1) / COMPACT_STEP + 1;
+	cells.resize(n);
+	t.resize(n);
+	for(unsigned i = 0; i < n; i++) {
+		unsigned cell = std::min(i / COMPACT_STEP, coarse_n - 2);
+		unsigned from = cell * COMPACT_STEP;
+		unsigned to = std::min((cell + 1) * COMPACT_STEP, n - 1);
+		cells[i] = cell;
+		t[i] = float(i - from) / float(to - from);
+	}
+	return coarse_n;
+}
+
+void SyWarpGrid::compact()
+{
+	if(empty() || is_compact()) return;
+	
+	coarse_nx_ = coarse_cells(nx_, column_cells_, column_t_);
+	unsigned coarse_ny = coarse_cells(ny_, row_cells_, row_t_);
+	
+	// Pick the coarse nodes out of the full grid
+	coarse_.resize(coarse_nx_ * coarse_ny * 2);
+	for(unsigned cj = 0; cj < coarse_ny; cj++) {
+		unsigned j = std::min(cj * COMPACT_STEP, ny_ - 1);
+		for(unsigned ci = 0; ci < coarse_nx_; ci++) {
+			unsigned i = std::min(ci * COMPACT_STEP, nx_ - 1);
+			coarse_[(cj * coarse_nx_ + ci) * 2] = nodes_[(j * nx_ + i) * 2];
+			coarse_[(cj * coarse_nx_ + ci) * 2 + 1] = nodes_[(j * nx_ + i) * 2 + 1];
+		}
+	}
+	
+	// Store the difference of every node from the coarse grid. decode_nodes() adds the coarse grid to the
+	// residuals, so with zero residuals we get just the interpolated coarse grid back.
+	residuals_.assign(nodes_.size(), 0);
+	std::vector<float> predicted(nx_ * 2);
+	for(unsigned j = 0; j < ny_; j++) {
+		decode_nodes(0, j, nx_, &predicted[0]);
+		for(unsigned v = 0; v < nx_ * 2; v++) {
+			residuals_[j * nx_ * 2 + v] = float_to_half(nodes_[j * nx_ * 2 + v] - predicted[v]);
+		}
+	}
+	
+	std::vector<float>().swap(nodes_);
+}
+
+// Writes the mapped coordinates of count nodes from column i on in row j into xy, interleaved.
+// All the lookups get the nodes from here so that they work with both storages.
+void SyWarpGrid::decode_nodes(unsigned i, unsigned j, unsigned count, float* xy) const
+{
+	if(!is_compact()) {
+		const float* node = &nodes_[(j * nx_ + i) * 2];
+		std::copy(node, node + count * 2, xy);
+		return;
+	}
+	
+	decode_halfs(&residuals_[(j * nx_ + i) * 2], xy, count * 2);
+	
+	const float ty = row_t_[j];
+	const float* coarse_bottom = &coarse_[row_cells_[j] * coarse_nx_ * 2];
+	const float* coarse_top = coarse_bottom + coarse_nx_ * 2;
+	for(unsigned n = 0; n < count; n++) {
+		const unsigned c = column_cells_[i + n] * 2;
+		const float tx = column_t_[i + n];
+		for(unsigned axis = 0; axis < 2; axis++) {
+			float bottom = coarse_bottom[c + axis] + (coarse_bottom[c + 2 + axis] - coarse_bottom[c + axis]) * tx;
+			float top = coarse_top[c + axis] + (coarse_top[c + 2 + axis] - coarse_top[c + axis]) * tx;
+			xy[n * 2 + axis] += bottom + (top - bottom) * ty;
+		}
+	}
+}
+
+Vector2 SyWarpGrid::node_position(unsigned i, unsigned j) const
+{
+	return Vector2(left_ + step_x_ * i, bottom_ + step_y_ * j);
+}
+
+void SyWarpGrid::set(unsigned i, unsigned j, const Vector2& mapped)
+{
+	float* node = &nodes_[(j * nx_ + i) * 2];
+	node[0] = mapped.x;
+	node[1] = mapped.y;
+}
+
+bool SyWarpGrid::contains(double x, double y) const
+{
+	if(empty()) return false;
+	
+	double fx = (x - left_) * inv_step_x_;
+	double fy = (y - bottom_) * inv_step_y_;
+	return fx >= 0 && fy >= 0 && fx <= (nx_ - 1) && fy <= (ny_ - 1);
+}
+
+bool SyWarpGrid::lookup_bilinear(Vector2& pt) const
+{
+	if(!contains(pt.x, pt.y)) return false;
+	
+	double fx = (pt.x - left_) * inv_step_x_;
+	double fy = (pt.y - bottom_) * inv_step_y_;
+	
+	// The last row and column have no right/upper neighbour, so they interpolate
+	// from the cell below them with t = 1
+	unsigned ix = std::min((unsigned)fx, nx_ - 2);
+	unsigned iy = std::min((unsigned)fy, ny_ - 2);
+	double tx = fx - ix;
+	double ty = fy - iy;
+	
+	float bottom_left[4], top_left[4];
+	decode_nodes(ix, iy, 2, bottom_left);
+	decode_nodes(ix, iy + 1, 2, top_left);
+	
+	double bottom_x = bottom_left[0] + (bottom_left[2] - bottom_left[0]) * tx;
+	double bottom_y = bottom_left[1] + (bottom_left[3] - bottom_left[1]) * tx;
+	double top_x = top_left[0] + (top_left[2] - top_left[0]) * tx;
+	double top_y = top_left[1] + (top_left[3] - top_left[1]) * tx;
+	
+	pt.x = bottom_x + (top_x - bottom_x) * ty;
+	pt.y = bottom_y + (top_y - bottom_y) * ty;
+	return true;
+}
+
+// Catmull-Rom weights for the four nodes around t (at -1, 0, 1 and 2)
+static inline void catmull_rom_weights(double t, double* w)
+{
+	double t2 = t * t;
+	double t3 = t2 * t;
+	w[0] = 0.5 * (-t3 + 2 * t2 - t);
+	w[1] = 0.5 * (3 * t3 - 5 * t2 + 2);
+	w[2] = 0.5 * (-3 * t3 + 4 * t2 + t);
+	w[3] = 0.5 * (t3 - t2);
+}
+
+// Returns the node at column i and row j, where i and j may be one node outside of the grid
+void SyWarpGrid::extrapolated_node(int i, int j, double& x, double& y) const
+{
+	int last_col = nx_ - 1;
+	int last_row = ny_ - 1;
+	
+	if(i < 0 || i > last_col) {
+		int edge = i < 0 ? 0 : last_col;
+		int inner = i < 0 ? 1 : last_col - 1;
+		double edge_x, edge_y, inner_x, inner_y;
+		extrapolated_node(edge, j, edge_x, edge_y);
+		extrapolated_node(inner, j, inner_x, inner_y);
+		x = 2 * edge_x - inner_x;
+		y = 2 * edge_y - inner_y;
+		return;
+	}
+	
+	if(j < 0 || j > last_row) {
+		int edge = j < 0 ? 0 : last_row;
+		int inner = j < 0 ? 1 : last_row - 1;
+		double edge_x, edge_y, inner_x, inner_y;
+		extrapolated_node(i, edge, edge_x, edge_y);
+		extrapolated_node(i, inner, inner_x, inner_y);
+		x = 2 * edge_x - inner_x;
+		y = 2 * edge_y - inner_y;
+		return;
+	}
+	
+	float node[2];
+	decode_nodes(i, j, 1, node);
+	x = node[0];
+	y = node[1];
+}
+
+bool SyWarpGrid::lookup_bicubic(Vector2& pt) const
+{
+	if(!contains(pt.x, pt.y)) return false;
+	
+	double fx = (pt.x - left_) * inv_step_x_;
+	double fy = (pt.y - bottom_) * inv_step_y_;
+	unsigned ix = std::min((unsigned)fx, nx_ - 2);
+	unsigned iy = std::min((unsigned)fy, ny_ - 2);
+	
+	double wx[4], wy[4];
+	catmull_rom_weights(fx - ix, wx);
+	catmull_rom_weights(fy - iy, wy);
+	
+	double x = 0, y = 0;
+	
+	// Away from the edges the 4 nodes of every row are next to each other, so they get decoded in one go
+	if(ix >= 1 && ix + 2 < nx_ && iy >= 1 && iy + 2 < ny_) {
+		float row[8];
+		for(int j = 0; j < 4; j++) {
+			decode_nodes(ix - 1, iy - 1 + j, 4, row);
+			double row_x = row[0] * wx[0] + row[2] * wx[1] + row[4] * wx[2] + row[6] * wx[3];
+			double row_y = row[1] * wx[0] + row[3] * wx[1] + row[5] * wx[2] + row[7] * wx[3];
+			x += row_x * wy[j];
+			y += row_y * wy[j];
+		}
+		pt.x = x;
+		pt.y = y;
+		return true;
+	}
+	
+	// Past the edges of the grid the nodes are extrapolated linearly from the two outermost ones,
+	// clamping them would flatten the spline and cost a lot of precision in the border cells
+	for(int j = 0; j < 4; j++) {
+		double row_x = 0, row_y = 0;
+		for(int i = 0; i < 4; i++) {
+			double node_x, node_y;
+			extrapolated_node((int)ix - 1 + i, (int)iy - 1 + j, node_x, node_y);
+			row_x += node_x * wx[i];
+			row_y += node_y * wx[i];
+		}
+		x += row_x * wy[j];
+		y += row_y * wy[j];
+	}
+	
+	pt.x = x;
+	pt.y = y;
+	return true;
+}
+
+// The shared grids by their key, with the number of users
+struct SySharedGrid
+{
+	SyWarpGrid* grid;
+	unsigned users;
+};
+
+static std::map<U64, SySharedGrid> shared_grids;
+static Lock shared_grids_lock;
+
+const SyWarpGrid* SyWarpGridCache::acquire(U64 key)
+{
+	const SyWarpGrid* grid = 0;
+	shared_grids_lock.lock();
+	std::map<U64, SySharedGrid>::iterator found = shared_grids.find(key);
+	if(found != shared_grids.end()) {
+		found->second.users++;
+		grid = found->second.grid;
+	}
+	shared_grids_lock.unlock();
+	return grid;
+}
+
+const SyWarpGrid* SyWarpGridCache::publish(U64 key, SyWarpGrid* grid)
+{
+	grid->set_key(key);
+	
+	// The grids are big, so they get deleted after the lock is let go
+	SyWarpGrid* unused = 0;
+	shared_grids_lock.lock();
+	std::map<U64, SySharedGrid>::iterator found = shared_grids.find(key);
+	if(found != shared_grids.end()) {
+		unused = grid;
+		grid = found->second.grid;
+		found->second.users++;
+	} else {
+		SySharedGrid shared;
+		shared.grid = grid;
+		shared.users = 1;
+		shared_grids[key] = shared;
+	}
+	shared_grids_lock.unlock();
+	delete unused;
+	return grid;
+}
+
+void SyWarpGridCache::release(const SyWarpGrid* grid)
+{
+	if(!grid) return;
+	
+	SyWarpGrid* unused = 0;
+	shared_grids_lock.lock();
+	std::map<U64, SySharedGrid>::iterator found = shared_grids.find(grid->key());
+	if(found != shared_grids.end() && found->second.grid == grid) {
+		found->second.users--;
+		if(found->second.users == 0) {
+			unused = found->second.grid;
+			shared_grids.erase(found);
+		}
+	}
+	shared_grids_lock.unlock();
+	delete unused;
+}
@@ -0,0 +1,102 @@
+#ifndef SY_WARP_GRID_H
+#define SY_WARP_GRID_H
+
+#include <vector>
+#include <map>
+#include "DDImage/Vector2.h"
+#include "DDImage/Hash.h"
+
+using namespace DD::Image;
+
+// A regular grid of 2D coordinates spanning a rectangle of Syntheyes [-1..1, -1..1] coordinates.
+// Every node stores the coordinate the node position maps to, so a lookup in the grid can
+// replace evaluating the distortion for every point. The grid does not know anything
+// about the distortion itself - SyDistorter fills it in bake_apply_disto() or bake_remove_disto().
+class SyWarpGrid
+{
+public:
+	SyWarpGrid();
+	
+	// Allocates a grid of nx by ny nodes (at least 2 by 2) covering the rectangle from left,bottom to right,top
+	void resize(unsigned nx, unsigned ny, double left, double bottom, double right, double top);
+	
+	// Forgets all the nodes
+	void clear();
+	
+	unsigned width() const { return nx_; }
+	unsigned height() const { return ny_; }
+	bool empty() const { return nx_ == 0; }
+	
+	// The key identifies what has been baked into the grid, usually the hash of the distortion
+	// and the grid resolution. The owner uses it to decide whether the grid has to be rebaked.
+	U64 key() const { return key_; }
+	void set_key(U64 k) { key_ = k; }
+	
+	// Returns the position of the node at column i and row j
+	Vector2 node_position(unsigned i, unsigned j) const;
+	
+	// Assigns the mapped coordinate of the node at column i and row j
+	void set(unsigned i, unsigned j, const Vector2& mapped);
+	
+	// Returns true if the coordinate falls within the rectangle covered by the grid
+	bool contains(double x, double y) const;
+	
+	// Replaces the passed coordinate with the bilinearly interpolated mapped coordinate.
+	// Returns false and leaves the coordinate alone if it lies outside of the grid.
+	bool lookup_bilinear(Vector2& pt) const;
+	
+	// Same as lookup_bilinear() but interpolates with a Catmull-Rom spline over the 4x4 surrounding nodes.
+	// This is a lot more precise on smooth mappings so the grid can be much coarser for the same error.
+	bool lookup_bicubic(Vector2& pt) const;
+	
+	/*
+	Converts the baked grid to compact storage, about half the memory of the full floats. Call this once
+	all the nodes have been set. The nodes get stored as half floats, as the difference from a float grid
+	with a node every COMPACT_STEP nodes (interpolated bilinearly). Since the distortion is smooth that difference
+	is small, and the precision of a half float is relative to it's value (11 significant bits), so the error
+	stays at about 1/4000 of the largest difference - a few thousandths of a pixel on an 8K plate at most.
+	*/
+	void compact();
+	bool is_compact() const { return !residuals_.empty(); }
+	
+	// How many bytes the nodes take
+	size_t memory_size() const;
+
+private:
+	void extrapolated_node(int i, int j, double& x, double& y) const;
+	void decode_nodes(unsigned i, unsigned j, unsigned count, float* xy) const;
+	
+	unsigned nx_, ny_;
+	double left_, bottom_, step_x_, step_y_, inv_step_x_, inv_step_y_;
+	U64 key_;
+	
+	// Mapped X and Y of every node, interleaved, row by row from the bottom
+	std::vector<float> nodes_;
+	
+	// Compact storage. The coarse grid has a node at every COMPACT_STEP-th column and row and at the last ones,
+	// the residuals are the half float differences from it for every node, laid out like nodes_.
+	// For every column and row we keep the coarse cell it falls into and where within it.
+	unsigned coarse_nx_;
+	std::vector<float> coarse_;
+	std::vector<unsigned short> residuals_;
+	std::vector<unsigned> column_cells_, row_cells_;
+	std::vector<float> column_t_, row_t_;
+};
+
+// Baked grids shared by key within the plugin, so that the instances Nuke makes of a node for every view
+// (and other nodes with the same lens) bake a grid only once. A grid lives as long as someone uses it.
+class SyWarpGridCache
+{
+public:
+	// Returns the grid stored under key, or 0 if there is none. A returned grid has to be released.
+	static const SyWarpGrid* acquire(U64 key);
+	
+	// Stores a freshly baked grid under key and takes ownership of it, returning the grid to use from then on.
+	// If someone else stored one under the same key in the meantime, that one gets returned and the passed one deleted.
+	static const SyWarpGrid* publish(U64 key, SyWarpGrid* grid);
+	
+	// Tells the cache the grid is not used anymore. Passing 0 is allowed.
+	static void release(const SyWarpGrid* grid);
+};
+
+#endif
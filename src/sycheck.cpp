@@ -0,0 +1,430 @@
+/*
+
+sycheck runs random and edge case points through everything SyDistorter does and compares the results
+with SyReferenceDistorter, the frozen scalar implementation. It prints the largest and the mean error of
+every path for every lens, together with how many points per second the path and the reference do.
+Run it after touching anything in SyDistorter or SyWarpGrid.
+
+	sycheck [-points N] [-width PIXELS] [-seed S]
+
+	-points     random points in every set (default 100000)
+	-width      plate width used to express the errors in pixels (default 4096)
+	-seed       seed for the random points (default 1)
+
+The paths that compute the distortion exactly have to stay within their tolerance, if one of them does not
+sycheck says FAIL and exits with 1. The paths that interpolate from a grid are only reported since their
+error depends on the grid density.
+
+*/
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include "SyDistorter.cpp"
+#include "SyReference.cpp"
+#include "SyClock.h"
+
+// The lenses every path gets checked with
+struct CheckLens
+{
+	const char* name;
+	double k, k_cube, aspect, shift_u, shift_v;
+
+	// The anamorphic lenses have extra terms
+	bool anamorphic;
+	double kx, ky, kxy, kyx;
+
+	// Added to the tolerance of the exact paths, for lenses SyDistorter interpolates from a table
+	double table_tolerance;
+};
+
+static const CheckLens CHECK_LENSES[] = {
+	{ "identity",            0,      0,      1.78, 0,    0,     false },
+	{ "barrel",              -0.05,  0,      1.78, 0,    0,     false },
+	{ "pincushion",          0.08,   0.01,   1.78, 0,    0,     false },
+	{ "shifted",             -0.04,  0.02,   1.5,  0.1,  -0.07, false },
+	{ "cubic only",          0,      -0.1,   1.33, 0,    0,     false },
+	{ "extreme pincushion",  0.3,    0.1,    1.78, 0,    0,     false },
+	// The factor goes negative inside the table, so the image wraps around in the corners
+	{ "extreme barrel",      -0.3,   0,      2.39, 0,    0,     false },
+	{ "wraparound shifted",  -0.25,  -0.05,  1.78, 0.2,  0.15,  false },
+	// A 2x squeezed scope lens, desqueezed
+	{ "anamorphic",          -0.04,  0.01,   2.39, 0,    0,     true,  -0.02, 0.015, 0.01,  -0.01, 0.00001 },
+	{ "anamorphic shifted",  -0.06,  0,      2.39, 0.05, -0.03, true,  0.03,  -0.01, -0.02, 0.02,  0.00001 },
+	{ "anamorphic as radial", -0.05, 0,      1.78, 0,    0,     true,  0,     0,     0,     0,     0.00001 },
+};
+
+// The sets of points every lens gets checked with
+enum CheckSet { CHECK_IN_FRAME, CHECK_OFF_FRAME, CHECK_EDGES, NUM_CHECK_SETS };
+static const char* const CHECK_SET_NAMES[] = { "in frame", "off frame", "edges" };
+
+// Everything one path needs
+struct CheckContext
+{
+	SyDistorter* distorter;
+	const SyReferenceDistorter* reference;
+	SyWarpGrid* grid;
+	SyWarpGrid* compact_grid;
+};
+
+typedef void CheckFunction(CheckContext& c, std::vector<Vector2>& points);
+
+struct CheckPath
+{
+	const char* name;
+	CheckFunction* run;
+	CheckFunction* reference;
+
+	// Largest allowed error in Syntheyes coordinates (so that it does not depend on -width),
+	// or a negative value for the paths that only get reported
+	double tolerance;
+
+	// The points get converted to W-premultiplied UVs before running and back afterwards
+	bool uv;
+
+	// A tighter limit for the points within the frame, 0 to use the tolerance there too
+	double in_frame_tolerance;
+};
+
+static void reference_apply(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < points.size(); i++) c.reference->apply_disto(points[i]);
+}
+
+static void reference_remove(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < points.size(); i++) c.reference->remove_disto(points[i]);
+}
+
+static void path_apply(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < points.size(); i++) c.distorter->apply_disto(points[i]);
+}
+
+static void path_remove(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < points.size(); i++) c.distorter->remove_disto(points[i]);
+}
+
+static void path_apply_batch(CheckContext& c, std::vector<Vector2>& points)
+{
+	c.distorter->apply_disto(&points[0], (unsigned)points.size());
+}
+
+static void path_remove_batch(CheckContext& c, std::vector<Vector2>& points)
+{
+	c.distorter->remove_disto(&points[0], (unsigned)points.size());
+}
+
+// The float kernels, see SyPrecision
+static void path_apply_float(CheckContext& c, std::vector<Vector2>& points)
+{
+	c.distorter->set_precision(SY_PRECISION_FLOAT);
+	c.distorter->apply_disto(&points[0], (unsigned)points.size());
+	c.distorter->set_precision(SY_PRECISION_DOUBLE);
+}
+
+static void path_remove_float(CheckContext& c, std::vector<Vector2>& points)
+{
+	c.distorter->set_precision(SY_PRECISION_FLOAT);
+	c.distorter->remove_disto(&points[0], (unsigned)points.size());
+	c.distorter->set_precision(SY_PRECISION_DOUBLE);
+}
+
+static void path_apply_jacobian(CheckContext& c, std::vector<Vector2>& points)
+{
+	Vector2 d_dx, d_dy;
+	for(unsigned i = 0; i < points.size(); i++) c.distorter->apply_disto(points[i], d_dx, d_dy);
+}
+
+static void path_remove_jacobian(CheckContext& c, std::vector<Vector2>& points)
+{
+	Vector2 d_dx, d_dy;
+	for(unsigned i = 0; i < points.size(); i++) c.distorter->remove_disto(points[i], d_dx, d_dy);
+}
+
+// SyGeo works on card vertices with a scale, use one that is not a power of two
+static const double VECTOR3_SCALE = 1.37;
+
+// The vertices are stored divided by the scale, which rounds them differently. Past the wraparound
+// that can decide between converging and giving up, so the reference works on the same rounded vertices.
+static void reference_remove_vector3(CheckContext& c, std::vector<Vector2>& points)
+{
+	const double scale = VECTOR3_SCALE;
+	std::vector<Vector3> v(points.size());
+	for(unsigned i = 0; i < points.size(); i++) v[i].set(points[i].x / scale, points[i].y / scale, 1);
+	for(unsigned i = 0; i < points.size(); i++) {
+		Vector2 pt(v[i].x * scale, v[i].y * scale);
+		c.reference->remove_disto(pt);
+		v[i].set(pt.x / scale, pt.y / scale, 1);
+	}
+	for(unsigned i = 0; i < points.size(); i++) points[i].set(v[i].x * scale, v[i].y * scale);
+}
+
+static void path_remove_vector3(CheckContext& c, std::vector<Vector2>& points)
+{
+	const double scale = VECTOR3_SCALE;
+	std::vector<Vector3> v(points.size());
+	for(unsigned i = 0; i < points.size(); i++) v[i].set(points[i].x / scale, points[i].y / scale, 1);
+	c.distorter->remove_disto(&v[0], (unsigned)v.size(), scale);
+	for(unsigned i = 0; i < points.size(); i++) points[i].set(v[i].x * scale, v[i].y * scale);
+}
+
+// The UV paths get W-premultiplied UVs packed into the points, see to_uv()
+static std::vector<Vector4> uv_buffer;
+
+static void reference_distort_uv(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < uv_buffer.size(); i++) c.reference->distort_uv(uv_buffer[i], uv_buffer[i]);
+}
+
+static void path_distort_uv(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < uv_buffer.size(); i++) c.distorter->distort_uv(uv_buffer[i], uv_buffer[i]);
+}
+
+static void path_distort_uvs(CheckContext& c, std::vector<Vector2>& points)
+{
+	c.distorter->distort_uvs(&uv_buffer[0], &uv_buffer[0], (unsigned)uv_buffer.size());
+}
+
+static void path_distort_uv_table(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < uv_buffer.size(); i++) c.distorter->distort_uv(uv_buffer[i], uv_buffer[i], *c.grid);
+}
+
+static void path_grid_bilinear(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < points.size(); i++) {
+		if(!c.grid->lookup_bilinear(points[i])) c.distorter->apply_disto(points[i]);
+	}
+}
+
+static void path_grid_bicubic(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < points.size(); i++) {
+		if(!c.grid->lookup_bicubic(points[i])) c.distorter->apply_disto(points[i]);
+	}
+}
+
+static void path_compact_grid_bicubic(CheckContext& c, std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < points.size(); i++) {
+		if(!c.compact_grid->lookup_bicubic(points[i])) c.distorter->apply_disto(points[i]);
+	}
+}
+
+// Add new fast paths here, with the reference they have to agree with
+static const CheckPath CHECK_PATHS[] = {
+	{ "apply_disto",                path_apply,                 reference_apply,      0,      false },
+	{ "remove_disto",               path_remove,                reference_remove,     0,      false },
+	{ "apply_disto batch",          path_apply_batch,           reference_apply,      0,      false },
+	{ "remove_disto batch",         path_remove_batch,          reference_remove,     0,      false },
+	// The float kernels against the double ones, within the bounds documented on SyPrecision
+	{ "apply_disto float",          path_apply_float,           path_apply_batch,     0.000002, false, 0.0000015 },
+	{ "remove_disto float",         path_remove_float,          path_remove_batch,    0.000002, false, 0.0000015 },
+	{ "apply_disto jacobian",       path_apply_jacobian,        reference_apply,      0,      false },
+	{ "remove_disto jacobian",      path_remove_jacobian,       reference_remove,     0,      false },
+	// Computes in double without rounding to float in between. The float rounding in the reference
+	// gets amplified far outside the frame, to a few millionths (0.01 pixels of an 8K plate) three frames out
+	{ "remove_disto vector3",       path_remove_vector3,        reference_remove_vector3, 0.00002, false },
+	{ "distort_uv",                 path_distort_uv,            reference_distort_uv, 0,      true  },
+	{ "distort_uvs",                path_distort_uvs,           reference_distort_uv, 0,      true  },
+	{ "distort_uv table",           path_distort_uv_table,      reference_distort_uv, -1,     true  },
+	{ "grid bilinear",              path_grid_bilinear,         reference_apply,      -1,     false },
+	{ "grid bicubic",               path_grid_bicubic,          reference_apply,      -1,     false },
+	{ "compact grid bicubic",       path_compact_grid_bicubic,  reference_apply,      -1,     false },
+};
+
+// The grids cover a bit more than the frame, with a node every 16 pixels of a 4K plate
+static const unsigned CHECK_GRID_NODES = 257;
+static const double CHECK_GRID_EXTENT = 1.1;
+
+static double random_unit()
+{
+	return rand() / (double)RAND_MAX;
+}
+
+static void make_points(CheckSet set, const CheckLens& lens, unsigned count, std::vector<Vector2>& points)
+{
+	points.clear();
+
+	if(set == CHECK_IN_FRAME) {
+		for(unsigned i = 0; i < count; i++) points.push_back(Vector2(random_unit() * 2 - 1, random_unit() * 2 - 1));
+		return;
+	}
+
+	if(set == CHECK_OFF_FRAME) {
+		for(unsigned i = 0; i < count; i++) {
+			Vector2 pt(random_unit() * 6 - 3, random_unit() * 6 - 3);
+			if(fabs(pt.x) > 1 || fabs(pt.y) > 1) points.push_back(pt);
+		}
+		return;
+	}
+
+	// The centers, the corners and the middles of the edges, the axes through the optical center
+	// and the radii of the table nodes and halfway between them
+	points.push_back(Vector2(0, 0));
+	points.push_back(Vector2(lens.shift_u, lens.shift_v));
+	points.push_back(Vector2(-lens.shift_u, -lens.shift_v));
+	for(int y = -1; y <= 1; y++) {
+		for(int x = -1; x <= 1; x++) points.push_back(Vector2(x, y));
+	}
+
+	const double max_r = sqrt(lens.aspect * lens.aspect + 1);
+	for(unsigned i = 0; i <= 64 * 2 + 8; i++) {
+		double r = max_r * i / 128.0;
+		points.push_back(Vector2(r / lens.aspect + lens.shift_u, lens.shift_v));
+		points.push_back(Vector2(lens.shift_u, r + lens.shift_v));
+		points.push_back(Vector2(-r / lens.aspect / sqrt(2.0) - lens.shift_u, -r / sqrt(2.0) - lens.shift_v));
+	}
+}
+
+// Packs the points into W-premultiplied UVs for the UV paths. W varies to catch mistakes in dividing it out.
+static void to_uv(const std::vector<Vector2>& points)
+{
+	uv_buffer.resize(points.size());
+	for(unsigned i = 0; i < points.size(); i++) {
+		double w = 0.5 + (i % 7) * 0.25;
+		uv_buffer[i].set(((points[i].x / 2) + 0.5) * w, ((points[i].y / 2) + 0.5) * w, 0, w);
+	}
+}
+
+// The opposite of to_uv(), back to Syntheyes coordinates
+static void from_uv(std::vector<Vector2>& points)
+{
+	for(unsigned i = 0; i < points.size(); i++) {
+		double w = uv_buffer[i].w;
+		points[i].set(((uv_buffer[i].x / w) - 0.5) * 2, ((uv_buffer[i].y / w) - 0.5) * 2);
+	}
+}
+
+static double point_error(const Vector2& a, const Vector2& b)
+{
+	bool a_nan = a.x != a.x || a.y != a.y;
+	bool b_nan = b.x != b.x || b.y != b.y;
+	if(a_nan || b_nan) return a_nan == b_nan ? 0 : std::numeric_limits<double>::infinity();
+
+	double dx = (double)a.x - (double)b.x;
+	double dy = (double)a.y - (double)b.y;
+	return sqrt(dx * dx + dy * dy);
+}
+
+// Runs fn on a copy of the points and returns the seconds it took
+static double run_timed(CheckFunction* fn, CheckContext& c, const CheckPath& path, std::vector<Vector2>& points)
+{
+	if(path.uv) to_uv(points);
+	double start = sy_clock();
+	fn(c, points);
+	double elapsed = sy_clock() - start;
+	if(path.uv) from_uv(points);
+	return elapsed;
+}
+
+int main(int argc, char** argv)
+{
+	unsigned count = 100000;
+	double width = 4096;
+	unsigned seed = 1;
+
+	for(int i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-points") && i + 1 < argc) {
+			count = (unsigned)atoi(argv[++i]);
+		} else if(!strcmp(argv[i], "-width") && i + 1 < argc) {
+			width = atof(argv[++i]);
+		} else if(!strcmp(argv[i], "-seed") && i + 1 < argc) {
+			seed = (unsigned)atoi(argv[++i]);
+		} else {
+			fprintf(stderr, "Usage: sycheck [-points N] [-width PIXELS] [-seed S]\n");
+			return 1;
+		}
+	}
+	if(count == 0 || width <= 0) {
+		fprintf(stderr, "sycheck: need at least one point and a positive width\n");
+		return 1;
+	}
+
+	// Syntheyes coordinates go -1..1 over the width of the plate
+	const double px_per_unit = width / 2;
+
+	const unsigned num_lenses = sizeof(CHECK_LENSES) / sizeof(CHECK_LENSES[0]);
+	const unsigned num_paths = sizeof(CHECK_PATHS) / sizeof(CHECK_PATHS[0]);
+	bool failed = false;
+
+	printf("%-20s %-24s %14s %14s %-10s %10s %10s\n", "lens", "path", "max err px", "mean err px", "worst in", "Mpts/s", "ref Mpts/s");
+
+	for(unsigned l = 0; l < num_lenses; l++) {
+		const CheckLens& lens = CHECK_LENSES[l];
+
+		SyDistorter distorter;
+		distorter.set_coefficients(lens.k, lens.k_cube, lens.aspect);
+		distorter.set_center_shift(lens.shift_u, lens.shift_v);
+		SyReferenceDistorter reference(lens.k, lens.k_cube, lens.aspect, lens.shift_u, lens.shift_v);
+		if(lens.anamorphic) {
+			distorter.set_anamorphic_terms(lens.kx, lens.ky, lens.kxy, lens.kyx);
+			reference.set_anamorphic_terms(lens.kx, lens.ky, lens.kxy, lens.kyx);
+		}
+
+		SyWarpGrid grid, compact_grid;
+		grid.resize(CHECK_GRID_NODES, CHECK_GRID_NODES, -CHECK_GRID_EXTENT, -CHECK_GRID_EXTENT, CHECK_GRID_EXTENT, CHECK_GRID_EXTENT);
+		distorter.bake_apply_disto(grid);
+		compact_grid.resize(CHECK_GRID_NODES, CHECK_GRID_NODES, -CHECK_GRID_EXTENT, -CHECK_GRID_EXTENT, CHECK_GRID_EXTENT, CHECK_GRID_EXTENT);
+		distorter.bake_apply_disto(compact_grid);
+		compact_grid.compact();
+
+		CheckContext context = { &distorter, &reference, &grid, &compact_grid };
+
+		// Every path sees the same points
+		std::vector<Vector2> sets[NUM_CHECK_SETS];
+		srand(seed + l);
+		for(unsigned s = 0; s < NUM_CHECK_SETS; s++) make_points((CheckSet)s, lens, count, sets[s]);
+
+		for(unsigned p = 0; p < num_paths; p++) {
+			const CheckPath& path = CHECK_PATHS[p];
+			double max_error = 0, sum_error = 0, time = 0, reference_time = 0;
+			unsigned total = 0, worst_set = 0;
+			bool path_failed = false;
+
+			for(unsigned s = 0; s < NUM_CHECK_SETS; s++) {
+				std::vector<Vector2> expected = sets[s];
+				std::vector<Vector2> actual = sets[s];
+				reference_time += run_timed(path.reference, context, path, expected);
+				time += run_timed(path.run, context, path, actual);
+
+				double set_error = 0;
+				for(unsigned i = 0; i < actual.size(); i++) {
+					double error = point_error(actual[i], expected[i]) * px_per_unit;
+					sum_error += error;
+					set_error = std::max(set_error, error);
+					if(error > max_error) {
+						max_error = error;
+						worst_set = s;
+					}
+				}
+				total += (unsigned)actual.size();
+
+				double tolerance = path.tolerance;
+				if(s == CHECK_IN_FRAME && path.in_frame_tolerance > 0) tolerance = path.in_frame_tolerance;
+				tolerance += lens.table_tolerance;
+				if(path.tolerance >= 0 && !(set_error <= tolerance * px_per_unit)) path_failed = true;
+			}
+			failed = failed || path_failed;
+
+			printf("%-20s %-24s %14.6g %14.6g %-10s %10.2f %10.2f%s\n",
+				lens.name,
+				path.name,
+				max_error,
+				sum_error / total,
+				max_error > 0 ? CHECK_SET_NAMES[worst_set] : "-",
+				time > 0 ? total / time / 1000000.0 : 0,
+				reference_time > 0 ? total / reference_time / 1000000.0 : 0,
+				path_failed ? "  FAIL" : ""
+			);
+		}
+	}
+
+	printf(failed ? "FAIL\n" : "OK\n");
+	return failed ? 1 : 0;
+}
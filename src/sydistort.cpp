@@ -0,0 +1,144 @@
+/*
+
+sydistort applies or removes the Syntheyes lens distortion on 2D points, for tracking data that
+never has to go through Nuke. It uses the same SyDistorter as the plugins so the points end up
+exactly where SyLens would put them.
+
+	sydistort apply|remove [options] [input [output]]
+
+	-k <value>          quartic distortion (default 0)
+	-kcube <value>      cubic distortion (default 0)
+	-aspect <value>     aspect of the plate (default 1.78, or width / height with -plate)
+	-ushift <value>     horizontal center shift (default 0)
+	-vshift <value>     vertical center shift (default 0)
+	-anamorphic <kx> <ky> <kxy> <kyx>
+	                    use the anamorphic model with these horizontal, vertical and cross terms
+	-plate <w> <h>      the points are in pixels of a plate of that size instead of Syntheyes coordinates
+	-binary             the points are pairs of 32 bit floats instead of CSV
+
+Input and output default to stdin and stdout, "-" means the same.
+
+*/
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+#include "SyDistorter.cpp"
+#include "SyParallel.cpp"
+#include "SyPointStream.cpp"
+
+static const char* const USAGE = "Usage: sydistort apply|remove [-k K] [-kcube KCUBE] [-aspect ASPECT] "
+	"[-ushift U] [-vshift V] [-anamorphic KX KY KXY KYX] [-plate WIDTH HEIGHT] [-binary] [input [output]]\n";
+
+static int usage()
+{
+	fprintf(stderr, "%s", USAGE);
+	return 1;
+}
+
+static bool parse_number(const char* arg, double& value)
+{
+	char* end;
+	value = strtod(arg, &end);
+	return end != arg && *end == 0;
+}
+
+int main(int argc, char** argv)
+{
+	if(argc < 2) return usage();
+
+	bool remove;
+	if(!strcmp(argv[1], "apply")) {
+		remove = false;
+	} else if(!strcmp(argv[1], "remove")) {
+		remove = true;
+	} else {
+		return usage();
+	}
+
+	double k = 0, kcube = 0, aspect = 1.78, ushift = 0, vshift = 0;
+	double width = 0, height = 0;
+	double kx = 0, ky = 0, kxy = 0, kyx = 0;
+	bool aspect_given = false, anamorphic = false;
+	SyPointFormat format = SY_POINTS_CSV;
+	const char* paths[2] = { 0, 0 };
+	unsigned num_paths = 0;
+
+	for(int i = 2; i < argc; i++) {
+		const char* arg = argv[i];
+		bool ok = true;
+		if(!strcmp(arg, "-k") && i + 1 < argc) {
+			ok = parse_number(argv[++i], k);
+		} else if(!strcmp(arg, "-kcube") && i + 1 < argc) {
+			ok = parse_number(argv[++i], kcube);
+		} else if(!strcmp(arg, "-aspect") && i + 1 < argc) {
+			ok = parse_number(argv[++i], aspect) && aspect > 0;
+			aspect_given = true;
+		} else if(!strcmp(arg, "-ushift") && i + 1 < argc) {
+			ok = parse_number(argv[++i], ushift);
+		} else if(!strcmp(arg, "-vshift") && i + 1 < argc) {
+			ok = parse_number(argv[++i], vshift);
+		} else if(!strcmp(arg, "-anamorphic") && i + 4 < argc) {
+			ok = parse_number(argv[i + 1], kx) && parse_number(argv[i + 2], ky)
+				&& parse_number(argv[i + 3], kxy) && parse_number(argv[i + 4], kyx);
+			anamorphic = true;
+			i += 4;
+		} else if(!strcmp(arg, "-plate") && i + 2 < argc) {
+			ok = parse_number(argv[i + 1], width) && parse_number(argv[i + 2], height) && width >= 1 && height >= 1;
+			i += 2;
+		} else if(!strcmp(arg, "-binary")) {
+			format = SY_POINTS_BINARY;
+		} else if(arg[0] != '-' || !strcmp(arg, "-")) {
+			ok = num_paths < 2;
+			if(ok) paths[num_paths++] = arg;
+		} else {
+			ok = false;
+		}
+		if(!ok) return usage();
+	}
+
+	if(width > 0 && !aspect_given) aspect = width / height;
+
+	FILE* in = stdin;
+	FILE* out = stdout;
+#ifdef _WIN32
+	if(format == SY_POINTS_BINARY) {
+		_setmode(_fileno(stdin), _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
+	}
+#endif
+	const char* mode_in = format == SY_POINTS_BINARY ? "rb" : "r";
+	const char* mode_out = format == SY_POINTS_BINARY ? "wb" : "w";
+	if(paths[0] && strcmp(paths[0], "-")) in = fopen(paths[0], mode_in);
+	if(!in) {
+		fprintf(stderr, "sydistort: cannot read %s\n", paths[0]);
+		return 1;
+	}
+	if(paths[1] && strcmp(paths[1], "-")) out = fopen(paths[1], mode_out);
+	if(!out) {
+		fprintf(stderr, "sydistort: cannot write %s\n", paths[1]);
+		return 1;
+	}
+
+	SyDistorter distorter;
+	distorter.set_coefficients(k, kcube, aspect);
+	distorter.set_center_shift(ushift, vshift);
+	if(anamorphic) distorter.set_anamorphic_terms(kx, ky, kxy, kyx);
+
+	SyPointStream stream(distorter, remove);
+	if(width > 0) stream.set_plate_size((unsigned)width, (unsigned)height);
+
+	long count = stream.process(in, out, format);
+	if(in != stdin) fclose(in);
+	if(out != stdout && fclose(out) != 0) count = -1;
+
+	if(count < 0) {
+		fprintf(stderr, "sydistort: could not process the points\n");
+		return 1;
+	}
+	return 0;
+}
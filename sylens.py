@@ -14,3 +14,19 @@ platform.append('-')
 platform.append(str(nuke.NUKE_VERSION_MAJOR))
 
 nuke.pluginAppendPath(os.path.join(mydir, "plugins-64", ''.join(platform)))
+
+# Warm up the lens tables of the SyLens nodes in the background once a script is loaded,
+# so that the first render does not have to build them. Set SYLENS_PREWARM to switch it on.
+prewarm_classes = ('SyLens', 'SyCamera', 'SyUV', 'SyGeo', 'SyShader', 'SyCompose', 'SyLensDeep')
+
+def prewarm_lens_nodes():
+  for node in nuke.allNodes(recurseGroups = True):
+    if node.Class() not in prewarm_classes or not node.knob('prewarm'):
+      continue
+    if node.knob('disable') and node['disable'].value():
+      continue
+    # The node picks the bump up in knob_changed and hands the work to it's warm-up thread
+    node['prewarm'].setValue(int(node['prewarm'].value()) + 1)
+
+if os.environ.get('SYLENS_PREWARM') and nuke.GUI:
+  nuke.addOnScriptLoad(prewarm_lens_nodes)